@@ -19,13 +19,6 @@ class SatThresFunc {
     }
 };
 
-class AvgThresFunc {
-  public:
-    inline bool operator()(const QColor &c) {
-        return (c.red() + c.green() + c.blue()) / 3 > 100;
-    }
-};
-
 int AutoClip::operator()(const QImage &input,
                          ClipAlg::PointFArray &outputpoints,
                          QImage *outputimg) {
@@ -54,7 +47,7 @@ int AutoClip::operator()(const QImage &input,
     }*/
 
     {
-        GenericThresholdAlg<AvgThresFunc> alg(input);
+        AvgThresholdAlg alg(input, 100);
 
         alg.run();
         int pertrue = 100 * alg.trueCount() / alg.totalCount();
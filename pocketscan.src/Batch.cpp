@@ -0,0 +1,447 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <Batch.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QRunnable>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+
+#include <DiskCache.h>
+#include <ExportProgress.h>
+#include <ImageFileCache.h>
+#include <MainWindow.h> // for expandImageDirectory
+#include <PixelKernels.h>
+#include <Project.h>
+
+bool Batch::isBatch(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], "--batch") == 0)
+            return true;
+
+    return false;
+}
+
+void Batch::printUsage(void) {
+    fprintf(stderr,
+            "usage: PocketScan --batch [options] book.psbk|images...\n"
+            "       PocketScan --batch --books [options] books...\n"
+            "       PocketScan --batch --check-kernels\n"
+            "  --pdf file.pdf      export to a PDF file\n"
+            "  --images seed.jpg   export to a series of image files\n"
+            "  --quality n         JPEG quality of the PDF pages (%d)\n"
+            "  --dpi n             the PDF export resolution, 0 for full\n"
+            "  --lookahead n       the most pages to work on ahead of the\n"
+            "                      one being written (2 per cpu)\n"
+            "  --no-analyze        skip the auto rotate/clip/level checks\n"
+            "  --trace file.json   record a Chrome trace of the run\n"
+            "with --books, the books may also be directories of books or\n"
+            "text files listing books, one per line:\n"
+            "  --outdir dir        where to put the exports (book's dir)\n"
+            "  --format pdf|images what to export to (pdf)\n"
+            "  --jobs n            how many books to do at once (%d)\n"
+            "--check-kernels checks the SIMD pixel kernels against the plain\n"
+            "ones (POCKETSCAN_SIMD picks which SIMD ones)\n",
+            PdfWriter::DEFAULT_JPEG_QUALITY, defaultJobs());
+}
+
+static void printDone(const QString &what, int pages, double secs) {
+    printf("%s: %d pages in %.2f s (%.2f pages/s)\n",
+           what.toLocal8Bit().constData(), pages, secs,
+           secs > 0 ? pages / secs : 0.0);
+    fflush(stdout);
+}
+
+namespace {
+
+struct Options {
+    QString pdffilename, imagesfilename;
+    QStringList inputs;
+    int quality, dpi, lookahead;
+    bool analyze;
+    bool checkkernels;
+
+    // for --books
+    bool books;
+    QString outdir, format;
+    int jobs;
+};
+
+struct BookResult {
+    int code;
+    int pages;
+    double secs;
+
+    BookResult(void) : code(Batch::LOAD_EXIT), pages(0), secs(0) {}
+};
+
+} // namespace
+
+int Batch::defaultJobs(void) {
+    return std::max(2, QThread::idealThreadCount() / 4);
+}
+
+static bool parseArguments(const QStringList &args, Options &opt) {
+    opt.quality = PdfWriter::DEFAULT_JPEG_QUALITY;
+    opt.dpi = -1;
+    opt.lookahead = 0;
+    opt.analyze = true;
+    opt.checkkernels = false;
+    opt.books = false;
+    opt.format = "pdf";
+    opt.jobs = Batch::defaultJobs();
+
+    for (int i = 1; i < args.size(); ++i) {
+        const QString &arg = args[i];
+        bool hasvalue = i + 1 < args.size();
+        bool ok = true;
+
+        if (arg == "--batch")
+            continue;
+        else if (arg == "--no-analyze")
+            opt.analyze = false;
+        else if (arg == "--check-kernels")
+            opt.checkkernels = true;
+        else if (arg == "--books")
+            opt.books = true;
+        else if (arg == "--pdf" && hasvalue)
+            opt.pdffilename = args[++i];
+        else if (arg == "--images" && hasvalue)
+            opt.imagesfilename = args[++i];
+        else if (arg == "--quality" && hasvalue)
+            opt.quality = args[++i].toInt(&ok);
+        else if (arg == "--dpi" && hasvalue)
+            opt.dpi = args[++i].toInt(&ok);
+        else if (arg == "--lookahead" && hasvalue) {
+            opt.lookahead = args[++i].toInt(&ok);
+            ok = ok && opt.lookahead > 0;
+        } else if (arg == "--outdir" && hasvalue)
+            opt.outdir = args[++i];
+        else if (arg == "--format" && hasvalue) {
+            opt.format = args[++i];
+            ok = opt.format == "pdf" || opt.format == "images";
+        } else if (arg == "--jobs" && hasvalue) {
+            opt.jobs = args[++i].toInt(&ok);
+            ok = ok && opt.jobs > 0;
+        } else if (arg.startsWith("--"))
+            ok = false;
+        else
+            opt.inputs.append(arg);
+
+        if (!ok) {
+            fprintf(stderr, "bad argument: %s\n",
+                    arg.toLocal8Bit().constData());
+            return false;
+        }
+    }
+
+    if (opt.checkkernels)
+        return true;
+    if (opt.inputs.isEmpty())
+        return false;
+    if (!opt.books && opt.pdffilename.isEmpty() && opt.imagesfilename.isEmpty())
+        return false;
+
+    return true;
+}
+
+/// loads a book, or a list of images (and directories of images)
+static int loadInputs(Project &project, const QStringList &inputs) {
+    QString ext = QFileInfo(inputs[0]).suffix().toLower();
+
+    if (inputs.size() == 1 && (ext == "xml" || ext == "psbk")) {
+        if (!project.loadXML(inputs[0])) {
+            fprintf(stderr, "could not load %s\n",
+                    inputs[0].toLocal8Bit().constData());
+            return Batch::LOAD_EXIT;
+        }
+        project.setFileName(inputs[0]);
+    } else {
+        QStringList files;
+
+        for (int i = 0; i < inputs.size(); ++i) {
+            if (QFileInfo(inputs[i]).isDir())
+                expandImageDirectory(inputs[i], files);
+            else
+                files.append(inputs[i]);
+        }
+        files.sort();
+        project.appendFiles(files);
+    }
+
+    if (project.files().empty()) {
+        fprintf(stderr, "no pages to export in %s\n",
+                inputs[0].toLocal8Bit().constData());
+        return Batch::LOAD_EXIT;
+    }
+
+    return Batch::OK_EXIT;
+}
+
+/// analyzes and exports a loaded project, titling the output with title
+static int exportProject(const Options &opt, Project &project,
+                         const QString &title, const QString &pdffilename,
+                         const QString &imagesfilename) {
+    int pages = static_cast<int>(project.files().size());
+
+    if (opt.dpi >= 0)
+        project.setExportDpi(opt.dpi);
+    project.setExportLookahead(opt.lookahead);
+
+    if (opt.analyze) {
+        ConsoleExportProgress progress(title + "analyze");
+
+        project.autoAnalyze(&progress);
+        printDone(title + "analyze", pages, progress.elapsed());
+    }
+
+    if (!pdffilename.isEmpty()) {
+        ConsoleExportProgress progress(title + "pdf");
+
+        if (!project.exportToPdf(pdffilename, &progress, opt.quality)) {
+            fprintf(stderr, "could not write %s\n",
+                    pdffilename.toLocal8Bit().constData());
+            return Batch::EXPORT_EXIT;
+        }
+        printDone(title + "pdf", pages, progress.elapsed());
+    }
+
+    if (!imagesfilename.isEmpty()) {
+        ConsoleExportProgress progress(title + "images");
+
+        if (!project.exportToFiles(imagesfilename, &progress)) {
+            fprintf(stderr, "could not write %s\n",
+                    imagesfilename.toLocal8Bit().constData());
+            return Batch::EXPORT_EXIT;
+        }
+        printDone(title + "images", pages, progress.elapsed());
+    }
+
+    return Batch::OK_EXIT;
+}
+
+/// the books named by the inputs, expanding directories and lists
+static QStringList findBooks(const QStringList &inputs) {
+    QStringList books;
+
+    for (int i = 0; i < inputs.size(); ++i) {
+        QFileInfo info(inputs[i]);
+
+        if (info.isDir()) {
+            QFileInfoList found = QDir(inputs[i]).entryInfoList(
+                QStringList() << "*.psbk" << "*.xml", QDir::Files, QDir::Name);
+
+            for (int j = 0; j < found.size(); ++j)
+                books.append(found[j].filePath());
+        } else if (info.suffix().toLower() == "txt") {
+            QFile f(inputs[i]);
+
+            if (!f.open(QIODevice::ReadOnly)) {
+                fprintf(stderr, "could not read %s\n",
+                        inputs[i].toLocal8Bit().constData());
+                continue;
+            }
+
+            QTextStream in(&f);
+
+            while (!in.atEnd()) {
+                QString line(in.readLine().trimmed());
+
+                if (!line.isEmpty() && !line.startsWith('#'))
+                    books.append(line);
+            }
+        } else
+            books.append(inputs[i]);
+    }
+
+    return books;
+}
+
+/// where the given book of a --books run is exported to
+static QString bookOutput(const Options &opt, const QString &book) {
+    QFileInfo info(book);
+    QString base(info.completeBaseName());
+    QDir outdir(opt.outdir.isEmpty() ? info.absolutePath() : opt.outdir);
+
+    return QDir::cleanPath(outdir.absoluteFilePath(
+        base + (opt.format == "pdf" ? ".pdf" : "0001.jpg")));
+}
+
+/**
+ * Loads and exports one book of a --books run, within the shared page
+ * budget and through the shared caches.
+ *
+ * @author Aleksander Demko
+ */
+class BookRunner : public QRunnable {
+  public:
+    BookRunner(const Options &opt, const QString &book,
+               PagePipeline::Budget *budget, DiskCache *diskcache,
+               ImageFileCache *filecache, BookResult &result)
+        : dm_opt(opt), dm_book(book), dm_budget(budget),
+          dm_diskcache(diskcache), dm_filecache(filecache), dm_result(result) {
+    }
+
+    virtual void run(void) {
+        QElapsedTimer timer;
+        QString base(QFileInfo(dm_book).completeBaseName());
+        QString output(bookOutput(dm_opt, dm_book));
+        Project project;
+
+        timer.start();
+        // the pages all go on the global pool
+        project.setPagePool(0, dm_budget);
+        project.setDiskCache(dm_diskcache);
+        project.setFileCache(dm_filecache);
+
+        dm_result.code = loadInputs(project, QStringList(dm_book));
+        if (dm_result.code == Batch::OK_EXIT) {
+            dm_result.pages = static_cast<int>(project.files().size());
+            dm_result.code = exportProject(
+                dm_opt, project, base + " ",
+                dm_opt.format == "pdf" ? output : QString(),
+                dm_opt.format == "images" ? output : QString());
+        }
+        dm_result.secs = timer.nsecsElapsed() / 1.0e9;
+
+        if (dm_result.code == Batch::OK_EXIT)
+            printDone(base, dm_result.pages, dm_result.secs);
+    }
+
+  private:
+    const Options &dm_opt;
+    QString dm_book;
+    PagePipeline::Budget *dm_budget;
+    DiskCache *dm_diskcache;
+    ImageFileCache *dm_filecache;
+    BookResult &dm_result;
+};
+
+static int runBooks(const Options &opt) {
+    QStringList books(findBooks(opt.inputs));
+
+    if (books.isEmpty()) {
+        fprintf(stderr, "no books to export\n");
+        return Batch::LOAD_EXIT;
+    }
+
+    // two books with the same name would overwrite each other's output
+    QHash<QString, QString> outputs;
+
+    for (int i = 0; i < books.size(); ++i) {
+        QString output(bookOutput(opt, books[i]));
+
+        if (outputs.contains(output)) {
+            fprintf(stderr, "%s and %s would both export to %s\n",
+                    outputs[output].toLocal8Bit().constData(),
+                    books[i].toLocal8Bit().constData(),
+                    output.toLocal8Bit().constData());
+            return Batch::USAGE_EXIT;
+        }
+        outputs[output] = books[i];
+    }
+
+    QElapsedTimer total;
+    // all the pages of all the books are worked on by the global pool (the
+    // one the ImageAlgs use too, so the cores aren't oversubscribed), within
+    // this budget
+    PagePipeline::Budget budget;
+    // and decoded through this one cache (so within one budget, as a single
+    // book would be), with one disk cache for them and the Projects
+    DiskCache diskcache;
+    ImageFileCache filecache;
+    // and the books themselves are driven (and mostly wait) on these
+    QThreadPool bookpool;
+    std::vector<BookResult> results(books.size());
+
+    total.start();
+    filecache.setDiskCache(&diskcache);
+    bookpool.setMaxThreadCount(std::min(opt.jobs, books.size()));
+
+    for (int i = 0; i < books.size(); ++i)
+        bookpool.start(new BookRunner(opt, books[i], &budget, &diskcache,
+                                      &filecache, results[i]));
+    bookpool.waitForDone();
+
+    int ret = Batch::OK_EXIT, pages = 0, failed = 0;
+
+    for (int i = 0; i < books.size(); ++i) {
+        if (results[i].code != Batch::OK_EXIT) {
+            fprintf(stderr, "failed: %s\n",
+                    books[i].toLocal8Bit().constData());
+            ret = std::max(ret, results[i].code);
+            ++failed;
+        } else
+            pages += results[i].pages;
+    }
+
+    double secs = total.nsecsElapsed() / 1.0e9;
+
+    printf("books: %d done, %d failed, %.2f books/min\n",
+           books.size() - failed, failed,
+           secs > 0 ? (books.size() - failed) * 60 / secs : 0.0);
+    printDone("total", pages, secs);
+
+    return ret;
+}
+
+int Batch::run(const QStringList &args) {
+    Options opt;
+
+    if (!parseArguments(args, opt)) {
+        printUsage();
+        return USAGE_EXIT;
+    }
+
+    if (opt.checkkernels) {
+        bool ok = PixelKernels::check();
+
+        printf("kernels: %s %s\n", PixelKernels::instance().name,
+               ok ? "ok" : "FAILED");
+
+        return ok ? OK_EXIT : CHECK_EXIT;
+    }
+
+    if (opt.books)
+        return runBooks(opt);
+
+    QElapsedTimer total, timer;
+    Project project;
+
+    total.start();
+    timer.start();
+
+    int ret = loadInputs(project, opt.inputs);
+
+    if (ret != OK_EXIT)
+        return ret;
+
+    int pages = static_cast<int>(project.files().size());
+
+    printDone("load", pages, timer.nsecsElapsed() / 1.0e9);
+
+    ret = exportProject(opt, project, QString(), opt.pdffilename,
+                        opt.imagesfilename);
+    if (ret != OK_EXIT)
+        return ret;
+
+    printDone("total", pages, total.nsecsElapsed() / 1.0e9);
+
+    return OK_EXIT;
+}
@@ -0,0 +1,47 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_BATCH_H__
+#define __INCLUDED_POCKETSCAN_BATCH_H__
+
+#include <QStringList>
+
+/**
+ * The headless, command line mode (pocketscan --batch ...), which exports
+ * books without any GUI. Needs only a QCoreApplication.
+ *
+ * With --books, many books are exported at once, their pages all sharing
+ * one pool of threads, one budget of pages in flight and one file cache.
+ * Books that would export to the same file are refused up front.
+ *
+ * @author Aleksander Demko
+ */
+class Batch {
+  public:
+    /// the exit codes of run()
+    enum {
+        OK_EXIT = 0,
+        USAGE_EXIT = 1,
+        LOAD_EXIT = 2,   // couldn't load the book (or images)
+        EXPORT_EXIT = 3, // couldn't write the output
+        CHECK_EXIT = 4,  // --check-kernels found a difference
+    };
+
+    /// is --batch in the (raw) command line?
+    static bool isBatch(int argc, char *argv[]);
+
+    /// runs the batch given the (full) arguments, returning the exit code
+    static int run(const QStringList &args);
+
+    /// prints the command line help to stderr
+    static void printUsage(void);
+
+    /// how many books are done at once by --books, by default
+    static int defaultJobs(void);
+};
+
+#endif
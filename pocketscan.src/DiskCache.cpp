@@ -0,0 +1,194 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <DiskCache.h>
+
+#include <stdlib.h>
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <Stats.h>
+
+static const quint32 ITEM_MAGIC = 0x50534443; // PSDC
+// 2: previews are lossless, so items made from them match the source's
+static const quint32 ITEM_VERSION = 2;
+
+// once over the cap, trim down to this much of it
+static const double TRIM_FRACTION = 0.9;
+
+DiskCache::DiskCache(const QString &dir, qint64 maxbytes)
+    : dm_dir(dir.isEmpty() ? defaultDir() : dir),
+      dm_maxbytes(maxbytes < 0 ? defaultMaxBytes() : maxbytes), dm_bytes(-1) {
+}
+
+QString DiskCache::defaultDir(void) {
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+           "/previews";
+}
+
+qint64 DiskCache::defaultMaxBytes(void) {
+    const char *mb = getenv("POCKETSCAN_DISKCACHE_MB");
+
+    if (mb)
+        return static_cast<qint64>(atoll(mb)) * 1024 * 1024;
+
+    return static_cast<qint64>(DEFAULT_MAX_MB) * 1024 * 1024;
+}
+
+bool DiskCache::load(const QString &srcfilename, const QString &item,
+                     QByteArray &data) {
+    QString filename, key;
+
+    if (!isEnabled() || !itemFile(srcfilename, item, filename, key))
+        return false;
+
+    QFile f(dm_dir + "/" + filename);
+
+    if (!f.open(QIODevice::ReadOnly)) {
+        Stats::add("diskcache.misses");
+        return false;
+    }
+
+    QDataStream in(&f);
+    quint32 magic, version;
+    QString storedkey;
+
+    in.setVersion(QDataStream::Qt_5_0);
+    in >> magic >> version;
+    if (in.status() != QDataStream::Ok || magic != ITEM_MAGIC ||
+        version != ITEM_VERSION)
+        return false;
+
+    // guards against hash collisions
+    in >> storedkey;
+    if (storedkey != key)
+        return false;
+
+    in >> data;
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    Stats::add("diskcache.hits");
+
+    // its been used, as far as trim() is concerned
+    f.setFileTime(QDateTime::currentDateTimeUtc(),
+                  QFileDevice::FileModificationTime);
+
+    return true;
+}
+
+void DiskCache::store(const QString &srcfilename, const QString &item,
+                      const QByteArray &data) {
+    QString filename, key;
+
+    if (!isEnabled() || !itemFile(srcfilename, item, filename, key))
+        return;
+
+    QString path(dm_dir + "/" + filename);
+    QFileInfo old(path);
+    qint64 oldsize = old.exists() ? old.size() : 0;
+
+    QDir().mkpath(dm_dir);
+
+    // written to a temp file and then renamed, so that readers never see a
+    // partial item
+    QSaveFile f(path);
+
+    if (!f.open(QIODevice::WriteOnly))
+        return;
+
+    QDataStream out(&f);
+
+    out.setVersion(QDataStream::Qt_5_0);
+    out << ITEM_MAGIC << ITEM_VERSION << key << data;
+
+    if (out.status() != QDataStream::Ok || !f.commit())
+        return;
+
+    QMutexLocker L(&dm_lock);
+
+    if (dm_bytes < 0) {
+        QFileInfoList files(
+            QDir(dm_dir).entryInfoList(QStringList("*.bin"), QDir::Files));
+
+        dm_bytes = 0;
+        for (int i = 0; i < files.size(); ++i)
+            dm_bytes += files[i].size();
+    } else
+        dm_bytes += QFileInfo(path).size() - oldsize;
+
+    if (dm_bytes > dm_maxbytes)
+        trim();
+
+    Stats::set("diskcache.bytes", dm_bytes);
+}
+
+bool DiskCache::loadImage(const QString &srcfilename, const QString &item,
+                          QImage &img) {
+    QByteArray data;
+
+    return load(srcfilename, item, data) && img.loadFromData(data);
+}
+
+void DiskCache::storeImage(const QString &srcfilename, const QString &item,
+                           const QImage &img) {
+    if (!isEnabled() || img.isNull())
+        return;
+
+    QByteArray data;
+    QBuffer buf(&data);
+
+    buf.open(QIODevice::WriteOnly);
+
+    // lossless, so that whatever is computed from a cached preview is the
+    // same as from a freshly decoded one
+    QImageWriter writer(&buf, "png");
+
+    if (writer.write(img))
+        store(srcfilename, item, data);
+}
+
+bool DiskCache::itemFile(const QString &srcfilename, const QString &item,
+                         QString &outfilename, QString &outkey) const {
+    QFileInfo info(srcfilename);
+
+    if (!info.exists())
+        return false;
+
+    outkey = info.absoluteFilePath() + '\n' + QString::number(info.size()) +
+             '\n' + QString::number(info.lastModified().toMSecsSinceEpoch()) +
+             '\n' + item;
+    outfilename = QString::fromLatin1(
+                      QCryptographicHash::hash(outkey.toUtf8(),
+                                               QCryptographicHash::Sha1)
+                          .toHex()) +
+                  ".bin";
+
+    return true;
+}
+
+void DiskCache::trim(void) {
+    // oldest first
+    QFileInfoList files(QDir(dm_dir).entryInfoList(
+        QStringList("*.bin"), QDir::Files, QDir::Time | QDir::Reversed));
+    qint64 target = static_cast<qint64>(dm_maxbytes * TRIM_FRACTION);
+
+    for (int i = 0; i < files.size() && dm_bytes > target; ++i)
+        if (QFile::remove(files[i].absoluteFilePath())) {
+            dm_bytes -= files[i].size();
+            Stats::add("diskcache.evictions");
+        }
+}
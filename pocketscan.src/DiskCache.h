@@ -0,0 +1,94 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_DISKCACHE_H__
+#define __INCLUDED_POCKETSCAN_DISKCACHE_H__
+
+#include <QByteArray>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+
+/**
+ * A persistent cache of things derived from image files (reduced previews,
+ * histograms, auto clip results), kept in the user's cache directory so
+ * that they survive between runs.
+ *
+ * Items are keyed by the absolute path, size and modification time of their
+ * source file (so that changed files simply miss) and an item name, which
+ * should describe everything else the item depends on. Each item is its own
+ * small file. Once over maxBytes(), the least recently used (by the
+ * modification time of the item files, which load() touches) are deleted.
+ *
+ * All the functions are thread safe.
+ *
+ * @author Aleksander Demko
+ */
+class DiskCache {
+  public:
+    /**
+     * Constructor. An empty dir means defaultDir() and a negative maxbytes
+     * means defaultMaxBytes(). A maxbytes of 0 disables the cache.
+     *
+     * @author Aleksander Demko
+     */
+    DiskCache(const QString &dir = QString(), qint64 maxbytes = -1);
+
+    bool isEnabled(void) const { return dm_maxbytes > 0; }
+
+    const QString &dir(void) const { return dm_dir; }
+    qint64 maxBytes(void) const { return dm_maxbytes; }
+
+    /// the pocketscan directory under the platform's cache location
+    static QString defaultDir(void);
+
+    /**
+     * The default size cap: the POCKETSCAN_DISKCACHE_MB environment variable
+     * if set (0 disabling the cache), otherwise DEFAULT_MAX_MB.
+     *
+     * @author Aleksander Demko
+     */
+    static qint64 defaultMaxBytes(void);
+
+    static const int DEFAULT_MAX_MB = 512;
+
+    /**
+     * Loads the given item of the given source file. Returns false if its not
+     * in the cache (or the source file has changed since it was stored).
+     *
+     * @author Aleksander Demko
+     */
+    bool load(const QString &srcfilename, const QString &item,
+              QByteArray &data);
+    /// stores the given item, replacing any previous one
+    void store(const QString &srcfilename, const QString &item,
+               const QByteArray &data);
+
+    /// same as load, for images
+    bool loadImage(const QString &srcfilename, const QString &item,
+                   QImage &img);
+    /// same as store, for images, which are stored losslessly (as PNGs)
+    void storeImage(const QString &srcfilename, const QString &item,
+                    const QImage &img);
+
+  private:
+    /// the item's file name (in dm_dir) and full key, false on errors
+    bool itemFile(const QString &srcfilename, const QString &item,
+                  QString &outfilename, QString &outkey) const;
+
+    /// deletes the oldest items until somewhat under the cap
+    void trim(void);
+
+  private:
+    QString dm_dir;
+    qint64 dm_maxbytes;
+
+    QMutex dm_lock;
+    qint64 dm_bytes; // -1 until the directory is first scanned
+};
+
+#endif
@@ -0,0 +1,55 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <ExportProgress.h>
+
+#include <stdio.h>
+
+#include <QProgressDialog>
+
+// the least time between ConsoleExportProgress lines
+static const qint64 PRINT_MS = 1000;
+
+//
+// DialogExportProgress
+//
+
+void DialogExportProgress::setPageCount(int count) {
+    dm_dlg->setRange(0, count);
+}
+
+void DialogExportProgress::setPagesDone(int done) { dm_dlg->setValue(done); }
+
+bool DialogExportProgress::isCanceled(void) { return dm_dlg->wasCanceled(); }
+
+//
+// ConsoleExportProgress
+//
+
+ConsoleExportProgress::ConsoleExportProgress(const QString &title)
+    : dm_title(title), dm_lastprint(0), dm_count(0), dm_lastdone(-1) {
+    dm_timer.start();
+}
+
+void ConsoleExportProgress::setPageCount(int count) { dm_count = count; }
+
+void ConsoleExportProgress::setPagesDone(int done) {
+    qint64 now = dm_timer.elapsed();
+
+    if (done == dm_lastdone ||
+        (done < dm_count && now - dm_lastprint < PRINT_MS))
+        return;
+
+    double secs = now / 1000.0;
+
+    dm_lastprint = now;
+    dm_lastdone = done;
+    printf("%s: %d/%d pages, %.1f s, %.2f pages/s\n",
+           dm_title.toLocal8Bit().constData(), done, dm_count, secs,
+           secs > 0 ? done / secs : 0.0);
+    fflush(stdout);
+}
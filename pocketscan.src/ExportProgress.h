@@ -0,0 +1,76 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_EXPORTPROGRESS_H__
+#define __INCLUDED_POCKETSCAN_EXPORTPROGRESS_H__
+
+#include <QElapsedTimer>
+#include <QString>
+
+class QProgressDialog;
+
+/**
+ * Where the long running Project operations (exports, analysis) report
+ * their progress, and find out if they should stop.
+ *
+ * @author Aleksander Demko
+ */
+class ExportProgress {
+  public:
+    virtual ~ExportProgress() {}
+
+    /// the number of pages that will be done
+    virtual void setPageCount(int count) = 0;
+    /// the number of pages done so far
+    virtual void setPagesDone(int done) = 0;
+    /// should the operation stop?
+    virtual bool isCanceled(void) = 0;
+};
+
+/**
+ * Progress shown in a (GUI) QProgressDialog, whose cancel button
+ * cancels.
+ *
+ * @author Aleksander Demko
+ */
+class DialogExportProgress : public ExportProgress {
+  public:
+    DialogExportProgress(QProgressDialog *dlg) : dm_dlg(dlg) {}
+
+    virtual void setPageCount(int count);
+    virtual void setPagesDone(int done);
+    virtual bool isCanceled(void);
+
+  private:
+    QProgressDialog *dm_dlg;
+};
+
+/**
+ * Progress printed to stdout, about once a second, for batch runs.
+ * Never cancels.
+ *
+ * @author Aleksander Demko
+ */
+class ConsoleExportProgress : public ExportProgress {
+  public:
+    ConsoleExportProgress(const QString &title);
+
+    virtual void setPageCount(int count);
+    virtual void setPagesDone(int done);
+    virtual bool isCanceled(void) { return false; }
+
+    /// seconds since construction
+    double elapsed(void) const { return dm_timer.nsecsElapsed() / 1.0e9; }
+
+  private:
+    QString dm_title;
+    QElapsedTimer dm_timer;
+    qint64 dm_lastprint; // ms
+    int dm_count, dm_lastdone;
+};
+
+#endif
@@ -8,15 +8,24 @@
 #include <ImageAlg.h>
 
 #include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #include <QColor>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QMutex>
 #include <QRunnable>
 #include <QThreadPool>
 #include <QWaitCondition>
 
+#include <ImagePyramid.h>
 #include <MathUtil.h>
+#include <Stats.h>
+#include <Trace.h>
 
 #include <ImageFileCache.h> // for calcAspect
 
@@ -24,40 +33,160 @@
 // ThreadImageAlgRun
 //
 
+// the image is cut into about this many chunks per cpu, so that a few
+// slow chunks (say, the skewed corner of a ClipAlg) dont hold up the page
+static const int CHUNKS_PER_CPU = 8;
+// but never make chunks smaller than this many rows
+static const size_t MIN_CHUNK_ROWS = 4;
+
+// the workerIndex() of the current thread
+static thread_local int tl_workerindex = 0;
+
+// sets tl_workerindex for its lifetime, restoring the old one after
+// (in case this thread is already a worker of an outer run)
+class WorkerIndexSetter {
+  public:
+    WorkerIndexSetter(int worker) : dm_old(tl_workerindex) {
+        tl_workerindex = worker;
+    }
+    ~WorkerIndexSetter() { tl_workerindex = dm_old; }
+
+  private:
+    int dm_old;
+};
+
 struct ImageAlg::RunnableSharedArea {
-    ImageAlg *alg;
+    // each worker owns a contiguous range of chunks [next, end).
+    // it pops chunks off the front of its own range and when that runs dry,
+    // steals the back half of some other worker's range
+    struct ChunkRange {
+        QMutex mutex;
+        int next, end;
+    };
 
-    int aliveCount;
+    ImageAlg *alg;
+    // alg->name(), copied before any worker starts, as a late worker may
+    // only get to run after the alg itself is gone
+    const char *name;
+
+    // in tile mode, chunks are tiles numbered in row major order,
+    // otherwise chunks are bands of chunkrows rows
+    QSize tile;
+    int tilesacross;
+    size_t chunkrows;
+    int numchunks;
+    int numworkers;
+    std::unique_ptr<ChunkRange[]> ranges;
+
+    int doneCount; // the number of chunks processed so far
     QMutex mutex;
     QWaitCondition cond;
+
+    bool popChunk(int worker, int &chunk);
+    bool stealChunk(int worker, int &chunk);
+
+    void processChunk(int chunk);
+    void workerRun(int worker);
 };
 
 class ImageAlg::ImageAlgRunnable : public QRunnable {
   public:
-    ImageAlgRunnable(RunnableSharedArea *area, int y, int numrows);
+    ImageAlgRunnable(const std::shared_ptr<RunnableSharedArea> &area,
+                     int worker);
 
     virtual void run(void);
 
   private:
-    RunnableSharedArea *dm_area;
-    int dm_y, dm_numrows;
+    // shared, as a runnable that starts late might outlive the run() call
+    std::shared_ptr<RunnableSharedArea> dm_area;
+    int dm_worker;
 };
 
-ImageAlg::ImageAlgRunnable::ImageAlgRunnable(RunnableSharedArea *area, int y,
-                                             int numrows)
-    : dm_area(area), dm_y(y), dm_numrows(numrows) {}
+bool ImageAlg::RunnableSharedArea::popChunk(int worker, int &chunk) {
+    ChunkRange &mine = ranges[worker];
+    QMutexLocker L(&mine.mutex);
 
-void ImageAlg::ImageAlgRunnable::run(void) {
-    dm_area->alg->process(dm_y, dm_numrows);
+    if (mine.next >= mine.end)
+        return false;
 
-    {
-        QMutexLocker locker(&dm_area->mutex);
-        dm_area->aliveCount--;
+    chunk = mine.next++;
+    return true;
+}
+
+bool ImageAlg::RunnableSharedArea::stealChunk(int worker, int &chunk) {
+    for (int i = 1; i < numworkers; ++i) {
+        ChunkRange &victim = ranges[(worker + i) % numworkers];
+        int stolennext, stolenend;
+
+        {
+            QMutexLocker L(&victim.mutex);
+
+            if (victim.next >= victim.end)
+                continue;
 
-        dm_area->cond.wakeOne();
+            stolenend = victim.end;
+            stolennext = victim.next + (victim.end - victim.next) / 2;
+            victim.end = stolennext;
+        }
+
+        // process the first stolen chunk now, keep the rest for later
+        // (where it can in turn be stolen by others)
+        chunk = stolennext;
+
+        ChunkRange &mine = ranges[worker];
+        QMutexLocker L(&mine.mutex);
+
+        mine.next = stolennext + 1;
+        mine.end = stolenend;
+
+        return true;
     }
+
+    return false;
 }
 
+void ImageAlg::RunnableSharedArea::processChunk(int chunk) {
+    if (tile.isValid()) {
+        QRect r(QPoint((chunk % tilesacross) * tile.width(),
+                       (chunk / tilesacross) * tile.height()),
+                tile);
+
+        alg->processTile(r.intersected(
+            QRect(0, 0, static_cast<int>(alg->width()),
+                  static_cast<int>(alg->height()))));
+        return;
+    }
+
+    size_t y = chunk * chunkrows;
+
+    alg->process(y, std::min(chunkrows, alg->height() - y));
+}
+
+void ImageAlg::RunnableSharedArea::workerRun(int worker) {
+    TraceScope scope(name, "worker");
+    WorkerIndexSetter setter(worker);
+    int chunk, mycount = 0;
+
+    while (popChunk(worker, chunk) || stealChunk(worker, chunk)) {
+        processChunk(chunk);
+        ++mycount;
+    }
+
+    if (mycount > 0) {
+        QMutexLocker L(&mutex);
+
+        doneCount += mycount;
+        if (doneCount == numchunks)
+            cond.wakeAll();
+    }
+}
+
+ImageAlg::ImageAlgRunnable::ImageAlgRunnable(
+    const std::shared_ptr<RunnableSharedArea> &area, int worker)
+    : dm_area(area), dm_worker(worker) {}
+
+void ImageAlg::ImageAlgRunnable::run(void) { dm_area->workerRun(dm_worker); }
+
 void ImageAlg::threadImageAlgRun(ImageAlg *alg, int numcpu) {
     assert(numcpu >= 0);
 
@@ -67,37 +196,83 @@ void ImageAlg::threadImageAlgRun(ImageAlg *alg, int numcpu) {
     if (numcpu == 0)
         numcpu = pool->maxThreadCount();
 
-    if (numcpu <= 1 || numcpu > alg->height()) {
+    std::shared_ptr<RunnableSharedArea> area(new RunnableSharedArea);
+    size_t h = alg->height();
+    int numchunks;
+
+    area->alg = alg;
+    area->name = alg->name();
+    area->tile = alg->tileSize();
+
+    if (area->tile.isValid()) {
+        int w = static_cast<int>(alg->width());
+
+        area->tilesacross = (w + area->tile.width() - 1) / area->tile.width();
+        area->chunkrows = 0;
+        numchunks = area->tilesacross *
+                    static_cast<int>((h + area->tile.height() - 1) /
+                                     area->tile.height());
+    } else {
+        area->tilesacross = 0;
+        area->chunkrows = std::max(
+            MIN_CHUNK_ROWS, h / (std::max(numcpu, 1) * CHUNKS_PER_CPU));
+        numchunks =
+            static_cast<int>((h + area->chunkrows - 1) / area->chunkrows);
+    }
+
+    if (numcpu > numchunks)
+        numcpu = numchunks;
+
+    if (numcpu <= 1) {
         // cant seem to auto detect the number of cpu? just run one thread then
-        // or we have more processors than lines
-        alg->process(0, alg->height());
+        // or the image is too small to be worth splitting
+        WorkerIndexSetter setter(0);
+
+        alg->beginRun(1);
+        if (area->tile.isValid())
+            for (int chunk = 0; chunk < numchunks; ++chunk)
+                area->processChunk(chunk);
+        else
+            alg->process(0, h);
+        alg->endRun();
         return;
     }
 
-    assert(numcpu > 1);
+    alg->beginRun(numcpu);
 
-    RunnableSharedArea area;
-    area.alg = alg;
-    area.aliveCount = numcpu;
+    area->numchunks = numchunks;
+    area->numworkers = numcpu;
+    area->ranges.reset(new RunnableSharedArea::ChunkRange[numcpu]);
+    area->doneCount = 0;
 
-    int jobsize = alg->height() / numcpu;
-    int joby = 0;
+    for (int i = 0; i < numcpu; ++i) {
+        area->ranges[i].next = i * numchunks / numcpu;
+        area->ranges[i].end = (i + 1) * numchunks / numcpu;
+    }
 
-    assert(jobsize > 0);
+    // worker 0 is this thread. only use the pool threads that are free right
+    // now, the others would just show up after all the work has been stolen
+    for (int i = 1; i < numcpu; ++i) {
+        ImageAlgRunnable *r = new ImageAlgRunnable(area, i);
 
-    for (int i = 0; i < (numcpu - 1); ++i) {
-        pool->start(new ImageAlgRunnable(&area, joby, jobsize));
-        joby += jobsize;
+        if (!pool->tryStart(r)) {
+            delete r;
+            break;
+        }
     }
-    // do the last, possibly odd sizes job
-    pool->start(new ImageAlgRunnable(&area, joby, alg->height() - joby));
+
+    area->workerRun(0);
 
     {
-        QMutexLocker l(&area.mutex);
+        // waiting for the pool workers still finishing their last chunks
+        TraceScope scope("barrier", "alg");
+        QMutexLocker l(&area->mutex);
 
-        while (area.aliveCount > 0)
-            area.cond.wait(&area.mutex);
+        while (area->doneCount < area->numchunks)
+            area->cond.wait(&area->mutex);
     }
+
+    alg->endRun();
 }
 
 //
@@ -109,43 +284,131 @@ void ImageAlg::threadImageAlgRun(ImageAlg *alg, int numcpu) {
 void ImageAlg::run(int numcpu) {
     assert(numcpu >= 0);
 
-    if (numcpu == 1)
-        process(0, height());
-    else
-        threadImageAlgRun(this, numcpu);
+    TraceScope scope(name(), "alg");
+    QElapsedTimer timer;
+
+    timer.start();
+
+    threadImageAlgRun(this, numcpu);
+
+    double ms = timer.nsecsElapsed() / 1.0e6;
+    QByteArray prefix(QByteArray("alg.") + name());
+
+    Stats::record(prefix + "_ms", ms);
+    if (width() > 0 && ms > 0)
+        Stats::record(prefix + "_mpps",
+                      static_cast<double>(width()) * height() / (ms * 1000));
+}
+
+int ImageAlg::workerIndex(void) { return tl_workerindex; }
+
+// can the PixelKernels be used on the given image?
+static bool isKernelFormat(const QImage &img) {
+    return img.format() == QImage::Format_RGB32 ||
+           img.format() == QImage::Format_ARGB32;
 }
 
 //
 //
-// ClipAlg
+// RotatedView
 //
 //
 
-inline bool operator<(const QSize &l, const QSize &r) {
-    return l.width() < r.width() && l.height() < r.height();
+RotatedView::RotatedView(const QImage &src, int rotatecode) {
+    assert(canView(src));
+    assert(rotatecode >= 0 && rotatecode <= 3);
+
+    ptrdiff_t stride = src.bytesPerLine() / sizeof(QRgb);
+    ptrdiff_t right = src.width() - 1;
+    ptrdiff_t bottom = (src.height() - 1) * stride;
+
+    dm_origin = reinterpret_cast<const QRgb *>(src.constBits());
+
+    switch (rotatecode) {
+    case 0:
+        dm_stepx = 1;
+        dm_stepy = stride;
+        break;
+    case 1: // 90cw, the top left comes from the bottom left
+        dm_origin += bottom;
+        dm_stepx = -stride;
+        dm_stepy = 1;
+        break;
+    case 2:
+        dm_origin += bottom + right;
+        dm_stepx = -1;
+        dm_stepy = -stride;
+        break;
+    case 3: // 90ccw, the top left comes from the top right
+        dm_origin += right;
+        dm_stepx = stride;
+        dm_stepy = -1;
+        break;
+    }
+
+    if (rotatecode % 2 == 1) {
+        dm_width = src.height();
+        dm_height = src.width();
+    } else {
+        dm_width = src.width();
+        dm_height = src.height();
+    }
 }
 
-ClipAlg::ClipAlg(const QImage &src, const PointFArray &corners)
-    : dm_src(src), dm_corners(corners) {
-    int i;
+bool RotatedView::canView(const QImage &img) {
+    return img.format() == QImage::Format_RGB32 ||
+           img.format() == QImage::Format_ARGB32 ||
+           img.format() == QImage::Format_ARGB32_Premultiplied;
+}
+
+//
+//
+// RotateAlg
+//
+//
 
-    for (i = 0; i < dm_pix_corners.size(); ++i) {
-        dm_pix_corners[i].rx() =
-            static_cast<int>(dm_corners[i].x() * (dm_src.width() - 1));
-        dm_pix_corners[i].ry() =
-            static_cast<int>(dm_corners[i].y() * (dm_src.height() - 1));
+RotateAlg::RotateAlg(const QImage &src, int rotatecode)
+    : dm_view(src, rotatecode) {
+    dm_output = QImage(dm_view.width(), dm_view.height(), src.format());
+
+    // same as what QImage::transformed() does
+    if (rotatecode % 2 == 1) {
+        dm_output.setDotsPerMeterX(src.dotsPerMeterY());
+        dm_output.setDotsPerMeterY(src.dotsPerMeterX());
+    } else {
+        dm_output.setDotsPerMeterX(src.dotsPerMeterX());
+        dm_output.setDotsPerMeterY(src.dotsPerMeterY());
     }
+}
 
-    QSize newsize;
+void RotateAlg::process(size_t y, size_t numrows) {
+    processTile(QRect(0, y, dm_output.width(), numrows));
+}
+
+void RotateAlg::processTile(const QRect &tile) {
+    for (int y = tile.top(); y <= tile.bottom(); ++y) {
+        QRgb *out = reinterpret_cast<QRgb *>(dm_output.scanLine(y));
 
-    newsize.rwidth() =
-        std::max(pointDistance(dm_pix_corners[0], dm_pix_corners[1]),
-                 pointDistance(dm_pix_corners[2], dm_pix_corners[3]));
-    newsize.rheight() =
-        std::max(pointDistance(dm_pix_corners[0], dm_pix_corners[3]),
-                 pointDistance(dm_pix_corners[1], dm_pix_corners[2]));
+        for (int x = tile.left(); x <= tile.right(); ++x)
+            out[x] = dm_view.pixel(x, y);
+    }
+}
+
+//
+//
+// ClipAlg
+//
+//
 
-    dm_output = QImage(newsize, dm_src.format());
+inline bool operator<(const QSize &l, const QSize &r) {
+    return l.width() < r.width() && l.height() < r.height();
+}
+
+ClipAlg::ClipAlg(const QImage &src, const PointFArray &corners)
+    : dm_src(src), dm_corners(corners) {
+    dm_output = QImage(computePixCorners(dm_src.size(), dm_corners,
+                                         dm_pix_corners),
+                       dm_src.format());
 }
 
 void ClipAlg::resizeOutputByMax(QSize maxsize) {
@@ -160,15 +423,40 @@ void ClipAlg::resizeOutputByMax(QSize maxsize) {
         dm_output = QImage(newsize, dm_src.format());
 }
 
+QSize ClipAlg::computePixCorners(QSize srcsize, const PointFArray &corners,
+                                 PointArray &pixcorners) {
+    int i;
+
+    for (i = 0; i < pixcorners.size(); ++i) {
+        pixcorners[i].rx() =
+            static_cast<int>(corners[i].x() * (srcsize.width() - 1));
+        pixcorners[i].ry() =
+            static_cast<int>(corners[i].y() * (srcsize.height() - 1));
+    }
+
+    QSize newsize;
+
+    newsize.rwidth() = std::max(pointDistance(pixcorners[0], pixcorners[1]),
+                                pointDistance(pixcorners[2], pixcorners[3]));
+    newsize.rheight() = std::max(pointDistance(pixcorners[0], pixcorners[3]),
+                                 pointDistance(pixcorners[1], pixcorners[2]));
+
+    return newsize;
+}
+
 void ClipAlg::process(size_t y, size_t numrows) {
+    processTile(QRect(0, y, dm_output.width(), numrows));
+}
+
+void ClipAlg::processTile(const QRect &tile) {
     QPoint d;
 
-    for (d.ry() = y; d.y() < y + numrows; ++d.ry()) {
+    for (d.ry() = tile.top(); d.y() <= tile.bottom(); ++d.ry()) {
         QPoint leftp(lineFraction(d.y(), dm_output.size().height() - 1,
                                   dm_pix_corners[0], dm_pix_corners[3]));
         QPoint rightp(lineFraction(d.y(), dm_output.size().height() - 1,
                                    dm_pix_corners[1], dm_pix_corners[2]));
-        for (d.rx() = 0; d.x() < dm_output.size().width(); ++d.rx()) {
+        for (d.rx() = tile.left(); d.x() <= tile.right(); ++d.rx()) {
             QPoint srcp = lineFraction(d.x(), dm_output.size().width() - 1,
                                        leftp, rightp);
             dm_output.setPixel(d, dm_src.pixel(srcp));
@@ -181,7 +469,11 @@ void ClipAlg::process(size_t y, size_t numrows) {
 //
 
 InterClipAlg::InterClipAlg(const QImage &src, const PointFArray &corners)
-    : ClipAlg(src, corners) {}
+    : ClipAlg(src, corners), dm_pyramid(0), dm_maxlevel(0), dm_level(0) {}
+
+InterClipAlg::InterClipAlg(ImagePyramid &pyramid, const PointFArray &corners)
+    : ClipAlg(pyramid.base(), corners), dm_pyramid(&pyramid), dm_maxlevel(0),
+      dm_level(0) {}
 
 inline void addCol(double &r, double &g, double &b, double frac,
                    const QRgb &rgb) {
@@ -190,46 +482,461 @@ inline void addCol(double &r, double &g, double &b, double frac,
     b += qBlue(rgb) * frac;
 }
 
-void InterClipAlg::process(size_t y, size_t numrows) {
+// IMG is a QImage or a RotatedView
+template <class IMG>
+inline QRgb bilinearPixel(const IMG &src, const QPointF &srcp) {
+    QPoint srcint =
+        QPoint(static_cast<int>(srcp.x()), static_cast<int>(srcp.y()));
+
+    bool hasextraX = srcint.x() + 1 < src.width();
+    bool hasextraY = srcint.y() + 1 < src.height();
+
+    double xfrac = srcp.x() - srcint.x();
+    double yfrac = srcp.y() - srcint.y();
+
+    double r = 0, g = 0, b = 0;
+
+    addCol(r, g, b, (1 - xfrac) * (1 - yfrac),
+           src.pixel(srcint.x(), srcint.y()));
+    if (hasextraX)
+        addCol(r, g, b, xfrac * (1 - yfrac),
+               src.pixel(srcint.x() + 1, srcint.y()));
+    if (hasextraY)
+        addCol(r, g, b, (1 - xfrac) * yfrac,
+               src.pixel(srcint.x(), srcint.y() + 1));
+    if (hasextraX && hasextraY)
+        addCol(r, g, b, xfrac * yfrac,
+               src.pixel(srcint.x() + 1, srcint.y() + 1));
+
+    return qRgb(static_cast<int>(r), static_cast<int>(g), static_cast<int>(b));
+}
+
+// 32.32 fixed point, see PixelKernels::BilinearSpan
+static inline qint64 toFixed(double v) {
+    return static_cast<qint64>(floor(v * 4294967296.0 + 0.5));
+}
+
+/**
+ * Fills out[x0..x1], part of one output row of a clip, with the bilinear
+ * samples along the line from leftp (at x = 0) to rightp (at x = lastx).
+ *
+ * The samples that have their whole 2x2 neighbourhood within the view
+ * are done by PixelKernels::bilinearRow, the few at the edges by
+ * bilinearPixel().
+ *
+ * @author Aleksander Demko
+ */
+static void bilinearClipRow(const RotatedView &view, const QPointF &leftp,
+                            const QPointF &rightp, int lastx, int x0, int x1,
+                            QRgb *out) {
+    PixelKernels::BilinearSpan span;
+    double dx = lastx > 0 ? (rightp.x() - leftp.x()) / lastx : 0;
+    double dy = lastx > 0 ? (rightp.y() - leftp.y()) / lastx : 0;
+    qint64 fx = toFixed(leftp.x() + x0 * dx), fy = toFixed(leftp.y() + x0 * dy);
+    // a sample is interior if 0 <= pos < max in both directions
+    qint64 maxx = static_cast<qint64>(view.width() - 1)
+                  << PixelKernels::FIXED_SHIFT;
+    qint64 maxy = static_cast<qint64>(view.height() - 1)
+                  << PixelKernels::FIXED_SHIFT;
+    int first, last;
+
+    span.origin = view.origin();
+    span.pixstepx = view.stepX();
+    span.pixstepy = view.stepY();
+    span.stepx = toFixed(dx);
+    span.stepy = toFixed(dy);
+
+    // the positions are linear in x, so the interior samples are one run,
+    // peel off the edge samples at both ends
+    for (first = x0; first <= x1; ++first) {
+        qint64 px = fx + (first - x0) * span.stepx;
+        qint64 py = fy + (first - x0) * span.stepy;
+
+        if (px >= 0 && px < maxx && py >= 0 && py < maxy)
+            break;
+        out[first] =
+            bilinearPixel(view, lineFractionF(first, lastx, leftp, rightp));
+    }
+    for (last = x1; last >= first; --last) {
+        qint64 px = fx + (last - x0) * span.stepx;
+        qint64 py = fy + (last - x0) * span.stepy;
+
+        if (px >= 0 && px < maxx && py >= 0 && py < maxy)
+            break;
+        out[last] =
+            bilinearPixel(view, lineFractionF(last, lastx, leftp, rightp));
+    }
+
+    if (first > last)
+        return;
+
+    span.x = fx + (first - x0) * span.stepx;
+    span.y = fy + (first - x0) * span.stepy;
+
+    PixelKernels::instance().bilinearRow(span, out + first, last - first + 1);
+}
+
+void InterClipAlg::beginRun(int numworkers) {
+    if (!dm_pyramid)
+        return;
+
+    // pick the level now, and build it while its still safe to. the
+    // footprint is largest at one of the corners
+    int lastx = dm_output.width() - 1, lasty = dm_output.height() - 1;
+    double maxfootprint =
+        std::max(std::max(footprint(0, 0), footprint(lastx, 0)),
+                 std::max(footprint(0, lasty), footprint(lastx, lasty)));
+
+    // footprintLevel() caps by dm_maxlevel
+    dm_maxlevel = dm_pyramid->maxLevel();
+    dm_level = footprintLevel(maxfootprint);
+    dm_pyramid->prepare(dm_level);
+}
+
+QPointF InterClipAlg::mapPoint(int x, int y) const {
+    int lastx = std::max(dm_output.width() - 1, 1);
+    int lasty = std::max(dm_output.height() - 1, 1);
+    QPointF leftp(
+        lineFractionF(y, lasty, dm_pix_corners[0], dm_pix_corners[3]));
+    QPointF rightp(
+        lineFractionF(y, lasty, dm_pix_corners[1], dm_pix_corners[2]));
+
+    return lineFractionF(x, lastx, leftp, rightp);
+}
+
+double InterClipAlg::footprint(int x, int y) const {
+    QPointF p(mapPoint(x, y));
+    QPointF dx(mapPoint(x + 1, y) - p);
+    QPointF dy(mapPoint(x, y + 1) - p);
+
+    return std::max(sqrt(dx.x() * dx.x() + dx.y() * dx.y()),
+                    sqrt(dy.x() * dy.x() + dy.y() * dy.y()));
+}
+
+int InterClipAlg::footprintLevel(double footprint) const {
+    int l = 0;
+
+    // level l pixels are 2^l source pixels apart, so take the highest level
+    // that is still no coarser than the footprint
+    while (l < dm_maxlevel && footprint >= 2) {
+        footprint /= 2;
+        ++l;
+    }
+
+    return l;
+}
+
+void InterClipAlg::processTile(const QRect &tile) {
     QPoint d;
+    int l = dm_level;
+    const QImage &src = l > 0 ? dm_pyramid->level(l) : dm_src;
+
+    if (isKernelFormat(src)) {
+        RotatedView view(src, 0);
+
+        for (d.ry() = tile.top(); d.y() <= tile.bottom(); ++d.ry()) {
+            QRgb *out = reinterpret_cast<QRgb *>(dm_output.scanLine(d.y()));
+            QPointF leftp(lineFractionF(d.y(), dm_output.height() - 1,
+                                        dm_pix_corners[0], dm_pix_corners[3]));
+            QPointF rightp(lineFractionF(d.y(), dm_output.height() - 1,
+                                         dm_pix_corners[1], dm_pix_corners[2]));
+
+            if (l > 0) {
+                leftp = dm_pyramid->toLevel(leftp, l);
+                rightp = dm_pyramid->toLevel(rightp, l);
+            }
 
-    for (d.ry() = y; d.y() < y + numrows; ++d.ry()) {
+            bilinearClipRow(view, leftp, rightp, dm_output.width() - 1,
+                            tile.left(), tile.right(), out);
+        }
+        return;
+    }
+
+    for (d.ry() = tile.top(); d.y() <= tile.bottom(); ++d.ry()) {
         QPointF leftp(lineFractionF(d.y(), dm_output.size().height() - 1,
                                     dm_pix_corners[0], dm_pix_corners[3]));
         QPointF rightp(lineFractionF(d.y(), dm_output.size().height() - 1,
                                      dm_pix_corners[1], dm_pix_corners[2]));
-        for (d.rx() = 0; d.x() < dm_output.size().width(); ++d.rx()) {
+        for (d.rx() = tile.left(); d.x() <= tile.right(); ++d.rx()) {
             QPointF srcp = lineFractionF(d.x(), dm_output.size().width() - 1,
                                          leftp, rightp);
-            QPoint srcint =
-                QPoint(static_cast<int>(srcp.x()), static_cast<int>(srcp.y()));
-
-            bool hasextraX = srcint.x() + 1 < dm_src.width();
-            bool hasextraY = srcint.y() + 1 < dm_src.height();
-
-            double xfrac = srcp.x() - srcint.x();
-            double yfrac = srcp.y() - srcint.y();
-
-            double r = 0, g = 0, b = 0;
-
-            addCol(r, g, b, (1 - xfrac) * (1 - yfrac),
-                   dm_src.pixel(srcint.x(), srcint.y()));
-            if (hasextraX)
-                addCol(r, g, b, xfrac * (1 - yfrac),
-                       dm_src.pixel(srcint.x() + 1, srcint.y()));
-            if (hasextraY)
-                addCol(r, g, b, (1 - xfrac) * yfrac,
-                       dm_src.pixel(srcint.x(), srcint.y() + 1));
-            if (hasextraX && hasextraY)
-                addCol(r, g, b, xfrac * yfrac,
-                       dm_src.pixel(srcint.x() + 1, srcint.y() + 1));
-
-            dm_output.setPixel(d, qRgb(static_cast<int>(r), static_cast<int>(g),
-                                       static_cast<int>(b)));
+
+            dm_output.setPixel(d, bilinearPixel(dm_src, srcp));
         } // for x
     }     // for y
 }
 
+//
+// HalveAlg
+//
+
+HalveAlg::HalveAlg(const QImage &src) : dm_src(src) {
+    dm_output = QImage((src.width() + 1) / 2, (src.height() + 1) / 2,
+                       src.format() == QImage::Format_RGB32
+                           ? QImage::Format_RGB32
+                           : QImage::Format_ARGB32);
+    dm_output.setDotsPerMeterX(src.dotsPerMeterX() / 2);
+    dm_output.setDotsPerMeterY(src.dotsPerMeterY() / 2);
+}
+
+// the rounded average of each channel
+// the red and blue, and the alpha and green, channels are done together
+static inline QRgb averagePixel(QRgb a, QRgb b, QRgb c, QRgb d) {
+    quint32 rb = ((a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) +
+                  (d & 0x00FF00FF) + 0x00020002) >>
+                 2;
+    quint32 ag = (((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) +
+                  ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF) +
+                  0x00020002)
+                 << 6;
+
+    return (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+}
+
+void HalveAlg::process(size_t ystart, size_t numrows) {
+    int w = dm_output.width(), x, y;
+    int lastx = dm_src.width() - 1, lasty = dm_src.height() - 1;
+    bool fast = isKernelFormat(dm_src);
+
+    for (y = ystart; y < ystart + numrows; ++y) {
+        int y0 = 2 * y, y1 = std::min(2 * y + 1, lasty);
+        QRgb *out = reinterpret_cast<QRgb *>(dm_output.scanLine(y));
+
+        if (fast) {
+            const QRgb *in0 =
+                reinterpret_cast<const QRgb *>(dm_src.constScanLine(y0));
+            const QRgb *in1 =
+                reinterpret_cast<const QRgb *>(dm_src.constScanLine(y1));
+
+            for (x = 0; x < w; ++x) {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, lastx);
+
+                out[x] = averagePixel(in0[x0], in0[x1], in1[x0], in1[x1]);
+            }
+        } else
+            for (x = 0; x < w; ++x) {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, lastx);
+
+                out[x] = averagePixel(dm_src.pixel(x0, y0),
+                                      dm_src.pixel(x1, y0),
+                                      dm_src.pixel(x0, y1),
+                                      dm_src.pixel(x1, y1));
+            }
+    }
+}
+
+//
+// ScaleAlg
+//
+
+ScaleAlg::ScaleAlg(const QImage &src, const QSize &outsize) {
+    if (isKernelFormat(src))
+        dm_src = src;
+    else
+        dm_src = src.convertToFormat(src.hasAlphaChannel()
+                                         ? QImage::Format_ARGB32
+                                         : QImage::Format_RGB32);
+
+    dm_output = QImage(outsize, dm_src.format());
+    if (src.width() > 0 && src.height() > 0) {
+        dm_output.setDotsPerMeterX(src.dotsPerMeterX() * outsize.width() /
+                                   src.width());
+        dm_output.setDotsPerMeterY(src.dotsPerMeterY() * outsize.height() /
+                                   src.height());
+    }
+
+    computeTaps(dm_src.width(), outsize.width(), dm_xtaps, dm_xstarts);
+    computeTaps(dm_src.height(), outsize.height(), dm_ytaps, dm_ystarts);
+}
+
+void ScaleAlg::computeTaps(int srclen, int outlen, TapList &taps,
+                           std::vector<int> &starts) {
+    double scale = static_cast<double>(srclen) / std::max(outlen, 1);
+
+    taps.clear();
+    starts.resize(outlen + 1);
+
+    for (int i = 0; i < outlen; ++i) {
+        // the source span this output pixel covers, [a,b)
+        double a = i * scale, b = std::min((i + 1) * scale, double(srclen));
+        int first = static_cast<int>(a);
+        int last = std::min(static_cast<int>(ceil(b)), srclen) - 1;
+
+        starts[i] = static_cast<int>(taps.size());
+
+        if (last <= first) {
+            // growing (or exactly one pixel), just the one source pixel
+            Tap t = {std::min(first, srclen - 1), 1.0f};
+
+            taps.push_back(t);
+            continue;
+        }
+        for (int j = first; j <= last; ++j) {
+            double cover = std::min(b, j + 1.0) - std::max(a, double(j));
+            Tap t = {j, static_cast<float>(cover / (b - a))};
+
+            taps.push_back(t);
+        }
+    }
+    starts[outlen] = static_cast<int>(taps.size());
+}
+
+void ScaleAlg::process(size_t ystart, size_t numrows) {
+    int srcw = dm_src.width(), w = dm_output.width();
+    // one source row worth of channel sums, blue green red alpha
+    std::vector<float> sums(srcw * 4);
+
+    for (size_t y = ystart; y < ystart + numrows; ++y) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+
+        // first down, all the source rows into sums
+        for (int t = dm_ystarts[y]; t < dm_ystarts[y + 1]; ++t) {
+            const QRgb *in = reinterpret_cast<const QRgb *>(
+                dm_src.constScanLine(dm_ytaps[t].pos));
+            float weight = dm_ytaps[t].weight;
+            float *sum = &sums[0];
+
+            for (int x = 0; x < srcw; ++x, sum += 4) {
+                QRgb c = in[x];
+
+                sum[0] += weight * qBlue(c);
+                sum[1] += weight * qGreen(c);
+                sum[2] += weight * qRed(c);
+                sum[3] += weight * qAlpha(c);
+            }
+        }
+
+        // then across
+        QRgb *out = reinterpret_cast<QRgb *>(dm_output.scanLine(y));
+
+        for (int x = 0; x < w; ++x) {
+            float b = 0, g = 0, r = 0, a = 0;
+
+            for (int t = dm_xstarts[x]; t < dm_xstarts[x + 1]; ++t) {
+                const float *sum = &sums[dm_xtaps[t].pos * 4];
+                float weight = dm_xtaps[t].weight;
+
+                b += weight * sum[0];
+                g += weight * sum[1];
+                r += weight * sum[2];
+                a += weight * sum[3];
+            }
+            out[x] = qRgba(std::min(static_cast<int>(r + 0.5f), 255),
+                           std::min(static_cast<int>(g + 0.5f), 255),
+                           std::min(static_cast<int>(b + 0.5f), 255),
+                           std::min(static_cast<int>(a + 0.5f), 255));
+        }
+    }
+}
+
+//
+// PerspectiveClipAlg
+//
+
+PerspectiveClipAlg::PerspectiveClipAlg(const QImage &src,
+                                       const PointFArray &corners)
+    : ClipAlg(src, corners) {
+    computeHomography(dm_pix_corners, dm_homography);
+}
+
+// Heckbert's square to quad mapping
+void PerspectiveClipAlg::computeHomography(const PointArray &pixcorners,
+                                           Homography &h) {
+    double x0 = pixcorners[0].x(), y0 = pixcorners[0].y();
+    double x1 = pixcorners[1].x(), y1 = pixcorners[1].y();
+    double x2 = pixcorners[2].x(), y2 = pixcorners[2].y();
+    double x3 = pixcorners[3].x(), y3 = pixcorners[3].y();
+    double sx = x0 - x1 + x2 - x3;
+    double sy = y0 - y1 + y2 - y3;
+    double dx1 = x1 - x2, dx2 = x3 - x2;
+    double dy1 = y1 - y2, dy2 = y3 - y2;
+    double den = dx1 * dy2 - dx2 * dy1;
+
+    if ((sx == 0 && sy == 0) || den == 0) {
+        // a parallelogram (or a degenerate quad), so just an affine mapping
+        h[0] = x1 - x0;
+        h[1] = x3 - x0;
+        h[2] = x0;
+        h[3] = y1 - y0;
+        h[4] = y3 - y0;
+        h[5] = y0;
+        h[6] = 0;
+        h[7] = 0;
+        return;
+    }
+
+    h[6] = (sx * dy2 - dx2 * sy) / den;
+    h[7] = (dx1 * sy - sx * dy1) / den;
+    h[0] = x1 - x0 + h[6] * x1;
+    h[1] = x3 - x0 + h[7] * x3;
+    h[2] = x0;
+    h[3] = y1 - y0 + h[6] * y1;
+    h[4] = y3 - y0 + h[7] * y3;
+    h[5] = y0;
+}
+
+/**
+ * Fills out[x0..x1], part of output row y of an output of the given size,
+ * with the bilinear samples of the homography mapped points.
+ *
+ * The numerators and the denominator are linear along the row, so they are
+ * just stepped, and each sample costs one divide.
+ *
+ * @author Aleksander Demko
+ */
+template <class IMG>
+static void perspectiveClipRow(const IMG &src,
+                               const PerspectiveClipAlg::Homography &h,
+                               QSize outsize, int y, int x0, int x1,
+                               QRgb *out) {
+    double du = outsize.width() > 1 ? 1.0 / (outsize.width() - 1) : 0;
+    double v = outsize.height() > 1
+                   ? static_cast<double>(y) / (outsize.height() - 1)
+                   : 0;
+    double u = x0 * du;
+    double numx = h[0] * u + h[1] * v + h[2];
+    double numy = h[3] * u + h[4] * v + h[5];
+    double den = h[6] * u + h[7] * v + 1;
+    double maxx = src.width() - 1, maxy = src.height() - 1;
+
+    for (int x = x0; x <= x1; ++x) {
+        double inv = 1 / den;
+        // rounding can put the edge samples a hair outside of the image
+        QPointF srcp(std::min(std::max(numx * inv, 0.0), maxx),
+                     std::min(std::max(numy * inv, 0.0), maxy));
+
+        out[x] = bilinearPixel(src, srcp);
+
+        numx += h[0] * du;
+        numy += h[3] * du;
+        den += h[6] * du;
+    }
+}
+
+void PerspectiveClipAlg::processTile(const QRect &tile) {
+    int x, y;
+
+    if (isKernelFormat(dm_src)) {
+        RotatedView view(dm_src, 0);
+
+        for (y = tile.top(); y <= tile.bottom(); ++y)
+            perspectiveClipRow(
+                view, dm_homography, dm_output.size(), y, tile.left(),
+                tile.right(), reinterpret_cast<QRgb *>(dm_output.scanLine(y)));
+        return;
+    }
+
+    std::vector<QRgb> row(dm_output.width());
+
+    for (y = tile.top(); y <= tile.bottom(); ++y) {
+        perspectiveClipRow(dm_src, dm_homography, dm_output.size(), y,
+                           tile.left(), tile.right(), &row[0]);
+
+        for (x = tile.left(); x <= tile.right(); ++x)
+            dm_output.setPixel(x, y, row[x]);
+    }
+}
+
 //
 //
 // HistoAlg
@@ -237,41 +944,79 @@ void InterClipAlg::process(size_t y, size_t numrows) {
 //
 
 HistoAlg::HistoAlg(const QImage &src) : dm_src(src) {
-    int i;
+    for (int c = 0; c < NUM_CHANNELS; ++c) {
+        dm_count[c].fill(0);
+        dm_countmax[c] = 0;
+    }
+}
 
-    for (i = 0; i < SIZE; ++i)
-        dm_count[i] = 0;
-    dm_countmax = 0;
+void HistoAlg::beginRun(int numworkers) {
+    dm_workercounts.resize(numworkers);
+
+    for (int w = 0; w < numworkers; ++w)
+        for (int c = 0; c < NUM_CHANNELS; ++c)
+            dm_workercounts[w][c].fill(0);
 }
 
-void HistoAlg::process(size_t y, size_t numrows) {
-    int i;
+void HistoAlg::endRun(void) {
+    int w, c, i;
 
-    QPoint p;
-    QColor c;
+    for (w = 0; w < dm_workercounts.size(); ++w)
+        for (c = 0; c < NUM_CHANNELS; ++c)
+            for (i = 0; i < SIZE; ++i)
+                dm_count[c][i] += dm_workercounts[w][c][i];
 
-    HistoArray mycounts;
-    for (i = 0; i < SIZE; ++i)
-        mycounts[i] = 0;
-
-    for (p.ry() = y; p.ry() < y + numrows; ++p.ry())
-        for (p.rx() = 0; p.rx() < dm_src.width(); ++p.rx()) {
-            c.setRgb(dm_src.pixel(p));
-            int value = c.value() / HISTO_FACTOR;
-            assert(value >= 0);
-            assert(value < SIZE);
-            mycounts[value]++;
-        }
+    for (c = 0; c < NUM_CHANNELS; ++c)
+        for (i = 0; i < SIZE; ++i)
+            if (dm_count[c][i] > dm_countmax[c])
+                dm_countmax[c] = dm_count[c][i];
 
-    // output time
-    QMutexLocker l(&dm_outputmutex);
+    dm_workercounts.clear();
+}
 
-    for (i = 0; i < SIZE; ++i)
-        dm_count[i] += mycounts[i];
+void HistoAlg::process(size_t y, size_t numrows) {
+    ChannelArray &counts = dm_workercounts[workerIndex()];
+    HistoArray &value = counts[VALUE_CHANNEL];
+    HistoArray &red = counts[RED_CHANNEL];
+    HistoArray &green = counts[GREEN_CHANNEL];
+    HistoArray &blue = counts[BLUE_CHANNEL];
+    HistoArray &luma = counts[LUMA_CHANNEL];
+    int w = dm_src.width(), x;
+    size_t row;
+
+    if (isKernelFormat(dm_src)) {
+        const PixelKernels &kernels = PixelKernels::instance();
+        std::vector<uchar> values(w), lumas(w);
+
+        for (row = y; row < y + numrows; ++row) {
+            const QRgb *in =
+                reinterpret_cast<const QRgb *>(dm_src.constScanLine(row));
+
+            kernels.valueRow(in, values.data(), w);
+            kernels.lumaRow(in, lumas.data(), w);
+
+            for (x = 0; x < w; ++x) {
+                value[values[x] / HISTO_FACTOR]++;
+                red[qRed(in[x]) / HISTO_FACTOR]++;
+                green[qGreen(in[x]) / HISTO_FACTOR]++;
+                blue[qBlue(in[x]) / HISTO_FACTOR]++;
+                luma[lumas[x] / HISTO_FACTOR]++;
+            }
+        }
+        return;
+    }
 
-    for (i = 0; i < SIZE; ++i)
-        if (dm_count[i] > dm_countmax)
-            dm_countmax = dm_count[i];
+    for (row = y; row < y + numrows; ++row)
+        for (x = 0; x < w; ++x) {
+            QRgb rgb = dm_src.pixel(x, row);
+
+            value[std::max(std::max(qRed(rgb), qGreen(rgb)), qBlue(rgb)) /
+                  HISTO_FACTOR]++;
+            red[qRed(rgb) / HISTO_FACTOR]++;
+            green[qGreen(rgb) / HISTO_FACTOR]++;
+            blue[qBlue(rgb) / HISTO_FACTOR]++;
+            luma[qGray(rgb) / HISTO_FACTOR]++;
+        }
 }
 
 //
@@ -283,45 +1028,73 @@ void HistoAlg::process(size_t y, size_t numrows) {
 OldLevelAlg::OldLevelAlg(const QImage &src, const MarkArray &marks)
     : dm_src(src), dm_marks(marks) {
     dm_output = QImage(dm_src.width(), dm_src.height(), dm_src.format());
+
+    for (int i = 0; i < dm_valuetable.size(); ++i) {
+        int value = i;
+
+        if (value == dm_marks[1])
+            value = MID_OUT;
+        else if (value <= dm_marks[0])
+            value = 0;
+        else if (value >= dm_marks[2])
+            value = WHITE;
+        else if (value < dm_marks[1])
+            value =
+                MID_OUT * (value - dm_marks[0]) / (dm_marks[1] - dm_marks[0]);
+        else if (value > dm_marks[1])
+            value = (WHITE + 1 - MID_OUT) * (value - dm_marks[1]) /
+                        (dm_marks[2] - dm_marks[1]) +
+                    MID_OUT;
+        assert(value >= 0);
+        assert(value <= WHITE);
+
+        dm_valuetable[i] = value;
+    }
 }
 
 void OldLevelAlg::process(size_t ystart, size_t numrows) {
     int w = dm_output.width(), x, y;
     QColor c;
+    bool fast = isKernelFormat(dm_src);
+    std::vector<uchar> values(w);
+    // what setPixel() would add
+    QRgb opaque = dm_output.format() == QImage::Format_RGB32 ? 0xFF000000 : 0;
+
+    for (y = ystart; y < ystart + numrows; ++y) {
+        if (!fast) {
+            for (x = 0; x < w; ++x) {
+                c.setRgb(dm_src.pixel(x, y));
+                values[x] = c.value();
+            }
+        } else
+            PixelKernels::instance().valueRow(
+                reinterpret_cast<const QRgb *>(dm_src.constScanLine(y)),
+                values.data(), w);
 
-    for (y = ystart; y < ystart + numrows; ++y)
         for (x = 0; x < w; ++x) {
-            c.setRgb(dm_src.pixel(x, y));
-            int value = c.value();
-
-            if (value == dm_marks[1])
-                value = MID_OUT;
-            else if (value <= dm_marks[0])
-                value = 0;
-            else if (value >= dm_marks[2])
-                value = WHITE;
-            else if (value < dm_marks[1])
-                value = MID_OUT * (value - dm_marks[0]) /
-                        (dm_marks[1] - dm_marks[0]);
-            else if (value > dm_marks[1])
-                value = (WHITE + 1 - MID_OUT) * (value - dm_marks[1]) /
-                            (dm_marks[2] - dm_marks[1]) +
-                        MID_OUT;
-            assert(value >= 0);
-            assert(value <= WHITE);
+            int value = dm_valuetable[values[x]];
 
             // these 2-tests for explicit white/black seem to help
             // although getting a nice log based/curve leveler is probably the
             // 'right' solution
-            if (value == 0)
-                dm_output.setPixel(x, y, 0);
-            else if (value == WHITE)
-                dm_output.setPixel(x, y, 0xFFFFFF);
-            else {
+            if (value == 0) {
+                if (fast)
+                    reinterpret_cast<QRgb *>(dm_output.scanLine(y))[x] = opaque;
+                else
+                    dm_output.setPixel(x, y, 0);
+            } else if (value == WHITE) {
+                if (fast)
+                    reinterpret_cast<QRgb *>(dm_output.scanLine(y))[x] =
+                        opaque | 0xFFFFFF;
+                else
+                    dm_output.setPixel(x, y, 0xFFFFFF);
+            } else {
+                c.setRgb(dm_src.pixel(x, y));
                 c.setHsv(c.hue(), c.saturation(), value);
                 dm_output.setPixel(x, y, c.rgb());
             }
         }
+    }
 }
 
 //
@@ -332,48 +1105,143 @@ void OldLevelAlg::process(size_t ystart, size_t numrows) {
 
 NewLevelAlg::NewLevelAlg(const QImage &src, const MarkArray &marks,
                          const RangeArray &range)
-    : dm_src(src), dm_marks(marks), dm_range(range) {
-    assert(dm_range[0] < dm_range[1]);
+    : dm_src(src) {
+    assert(range[0] < range[1]);
+    computeChannelTable(marks, range, dm_table);
+    PixelKernels::makeLevelTable(dm_table.data(), dm_leveltable);
+    dm_output = QImage(dm_src.width(), dm_src.height(), dm_src.format());
+}
+
+NewLevelAlg::NewLevelAlg(const QImage &src, const ChannelTable &table)
+    : dm_src(src), dm_table(table) {
+    PixelKernels::makeLevelTable(dm_table.data(), dm_leveltable);
     dm_output = QImage(dm_src.width(), dm_src.height(), dm_src.format());
 }
 
-inline int NewLevelAlg::capChannel(int value) {
-    if (value == dm_marks[1])
+inline int NewLevelAlg::capChannel(int value, const MarkArray &marks,
+                                    const RangeArray &range) {
+    if (value == marks[1])
         value = MID_OUT;
-    else if (value <= dm_marks[0])
+    else if (value <= marks[0])
         value = 0;
-    else if (value >= dm_marks[2])
+    else if (value >= marks[2])
         value = WHITE;
-    else if (value < dm_marks[1])
-        value = MID_OUT * (value - dm_marks[0]) / (dm_marks[1] - dm_marks[0]);
-    else if (value > dm_marks[1])
-        value = (WHITE + 1 - MID_OUT) * (value - dm_marks[1]) /
-                    (dm_marks[2] - dm_marks[1]) +
+    else if (value < marks[1])
+        value = MID_OUT * (value - marks[0]) / (marks[1] - marks[0]);
+    else if (value > marks[1])
+        value = (WHITE + 1 - MID_OUT) * (value - marks[1]) /
+                    (marks[2] - marks[1]) +
                 MID_OUT;
 
     assert(value >= 0);
     assert(value <= WHITE);
 
     // new... scale the output value via the range array
-    value = (dm_range[1] - dm_range[0]) * value / WHITE + dm_range[0];
+    value = (range[1] - range[0]) * value / WHITE + range[0];
 
     return value;
 }
 
+void NewLevelAlg::computeChannelTable(const MarkArray &marks,
+                                      const RangeArray &range,
+                                      ChannelTable &table) {
+    for (int i = 0; i < table.size(); ++i)
+        table[i] = capChannel(i, marks, range);
+}
+
+inline QRgb levelPixel(QRgb rgb, const NewLevelAlg::ChannelTable &table) {
+    return qRgb(table[qRed(rgb)], table[qGreen(rgb)], table[qBlue(rgb)]);
+}
+
 void NewLevelAlg::process(size_t ystart, size_t numrows) {
     int w = dm_output.width(), x, y;
-    QColor c;
+
+    if (!isKernelFormat(dm_src)) {
+        // the slow way, for everything else
+        for (y = ystart; y < ystart + numrows; ++y)
+            for (x = 0; x < w; ++x)
+                dm_output.setPixel(x, y,
+                                   levelPixel(dm_src.pixel(x, y), dm_table));
+        return;
+    }
+
+    const PixelKernels &kernels = PixelKernels::instance();
 
     for (y = ystart; y < ystart + numrows; ++y)
-        for (x = 0; x < w; ++x) {
-            c.setRgb(dm_src.pixel(x, y));
+        kernels.levelRow(reinterpret_cast<const QRgb *>(dm_src.constScanLine(y)),
+                         reinterpret_cast<QRgb *>(dm_output.scanLine(y)), w,
+                         dm_leveltable);
+}
 
-            c.setRed(capChannel(c.red()));
-            c.setGreen(capChannel(c.green()));
-            c.setBlue(capChannel(c.blue()));
+//
+//
+// PageAlg
+//
+//
 
-            dm_output.setPixel(x, y, c.rgb());
-        } // for x
+PageAlg::PageAlg(const QImage &src, int rotatecode,
+                 const ClipAlg::PointFArray *corners,
+                 const NewLevelAlg::ChannelTable *table, int mapping)
+    : dm_view(src, rotatecode), dm_clip(corners != 0),
+      dm_perspective(mapping == ClipAlg::PERSPECTIVE_MAPPING),
+      dm_table(table) {
+    assert(canRender(src));
+
+    QSize newsize(dm_view.width(), dm_view.height());
+
+    if (dm_clip)
+        newsize = ClipAlg::computePixCorners(newsize, *corners, dm_pix_corners);
+    if (dm_clip && dm_perspective)
+        PerspectiveClipAlg::computeHomography(dm_pix_corners, dm_homography);
+
+    dm_output = QImage(newsize, src.format());
+}
+
+bool PageAlg::canRender(const QImage &src) {
+    // ARGB32_Premultiplied is left out, as QImage::pixel() (and therefor the
+    // separate algs) unpremultiply
+    return src.format() == QImage::Format_RGB32 ||
+           src.format() == QImage::Format_ARGB32;
+}
+
+void PageAlg::process(size_t y, size_t numrows) {
+    processTile(QRect(0, y, dm_output.width(), numrows));
+}
+
+void PageAlg::processTile(const QRect &tile) {
+    int x, y;
+
+    for (y = tile.top(); y <= tile.bottom(); ++y) {
+        QRgb *out = reinterpret_cast<QRgb *>(dm_output.scanLine(y));
+
+        if (!dm_clip) {
+            // no clipping means the output is the rotated source
+            if (dm_table)
+                for (x = tile.left(); x <= tile.right(); ++x)
+                    out[x] = levelPixel(dm_view.pixel(x, y), *dm_table);
+            else
+                for (x = tile.left(); x <= tile.right(); ++x)
+                    out[x] = dm_view.pixel(x, y);
+            continue;
+        }
+
+        if (dm_perspective)
+            perspectiveClipRow(dm_view, dm_homography, dm_output.size(), y,
+                               tile.left(), tile.right(), out);
+        else {
+            QPointF leftp(lineFractionF(y, dm_output.height() - 1,
+                                        dm_pix_corners[0], dm_pix_corners[3]));
+            QPointF rightp(lineFractionF(y, dm_output.height() - 1,
+                                         dm_pix_corners[1], dm_pix_corners[2]));
+
+            bilinearClipRow(dm_view, leftp, rightp, dm_output.width() - 1,
+                            tile.left(), tile.right(), out);
+        }
+
+        if (dm_table)
+            for (x = tile.left(); x <= tile.right(); ++x)
+                out[x] = levelPixel(out[x], *dm_table);
+    }
 }
 
 //
@@ -428,3 +1296,43 @@ ThresholdAlg::ThresholdAlg(const QImage &src) : dm_src(src) {
     dm_output = QImage(dm_src.width(), dm_src.height(), dm_src.format());
     dm_truecount = 0;
 }
+
+//
+// AvgThresholdAlg
+//
+
+AvgThresholdAlg::AvgThresholdAlg(const QImage &src, int thres)
+    : ThresholdAlg(src), dm_thres(thres) {}
+
+void AvgThresholdAlg::process(size_t ystart, size_t numrows) {
+    int w = dm_output.width(), x, y;
+    size_t mycount = 0;
+
+    if (isKernelFormat(dm_src)) {
+        const PixelKernels &kernels = PixelKernels::instance();
+
+        for (y = ystart; y < ystart + numrows; ++y)
+            mycount += kernels.avgThresholdRow(
+                reinterpret_cast<const QRgb *>(dm_src.constScanLine(y)),
+                reinterpret_cast<QRgb *>(dm_output.scanLine(y)), w, dm_thres);
+    } else {
+        QRgb W = QColor(Qt::white).rgb();
+        QRgb B = QColor(Qt::black).rgb();
+
+        for (y = ystart; y < ystart + numrows; ++y)
+            for (x = 0; x < w; ++x) {
+                QRgb rgb = dm_src.pixel(x, y);
+                bool b = (qRed(rgb) + qGreen(rgb) + qBlue(rgb)) / 3 > dm_thres;
+
+                dm_output.setPixel(x, y, b ? W : B);
+                if (b)
+                    ++mycount;
+            }
+    }
+
+    if (mycount > 0) {
+        QMutexLocker L(&dm_truemutex);
+
+        dm_truecount += mycount;
+    }
+}
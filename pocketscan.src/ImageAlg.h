@@ -8,12 +8,18 @@
 #ifndef __INCLUDED_POCKETSCAN_IMAGEALG_H__
 #define __INCLUDED_POCKETSCAN_IMAGEALG_H__
 
+#include <vector>
+
 #include <hydra/TR1.h>
 
 #include <QColor>
 #include <QImage>
 #include <QMutex>
 
+#include <PixelKernels.h>
+
+class ImagePyramid;
+
 /**
  * Base interface for all parallelizable image algorithms
  *
@@ -37,6 +43,48 @@ class ImageAlg {
 
     virtual void process(size_t y, size_t numrows) = 0;
 
+    /**
+     * Algorithms that would rather be driven in 2D tiles than in full width
+     * row bands (for cache reasons) return the wanted tile size here, and then
+     * must implement width() and processTile() too.
+     *
+     * The default, an invalid size, means row bands only.
+     *
+     * @author Aleksander Demko
+     */
+    virtual QSize tileSize(void) const { return QSize(); }
+
+    /// only needed by tile mode algorithms (and for the pixel rates in the
+    /// Stats)
+    virtual size_t width(void) const { return 0; }
+
+    /// the name this algorithm's runs are recorded under in the Stats
+    /// (a string literal, as late workers may still use it after the run)
+    virtual const char *name(void) const { return "ImageAlg"; }
+
+    /// processes one tile, only called if tileSize() is valid
+    virtual void processTile(const QRect &) {}
+
+    /**
+     * Called before any process() call, with the number of workers that
+     * might call process(). Algorithms that keep per worker state can
+     * allocate it here, and then index it by workerIndex() in process().
+     *
+     * @author Aleksander Demko
+     */
+    virtual void beginRun(int numworkers) {}
+
+    /// called after all the process() calls are done
+    virtual void endRun(void) {}
+
+    /**
+     * Returns the index (0 to numworkers-1, as given to beginRun()) of the
+     * worker, only valid within process().
+     *
+     * @author Aleksander Demko
+     */
+    static int workerIndex(void);
+
   private:
     struct RunnableSharedArea;
     class ImageAlgRunnable;
@@ -44,6 +92,67 @@ class ImageAlg {
     static void threadImageAlgRun(ImageAlg *alg, int numcpu);
 };
 
+/**
+ * A read-only view of the pixels of a 32-bit QImage, as if it
+ * had been rotated by the given TransformOp code (90 degree clockwise steps).
+ *
+ * @author Aleksander Demko
+ */
+class RotatedView {
+  public:
+    RotatedView(const QImage &src, int rotatecode);
+
+    /// can the given image be viewed? (that is, is it a 32-bit image)
+    static bool canView(const QImage &img);
+
+    int width(void) const { return dm_width; }
+    int height(void) const { return dm_height; }
+
+    QRgb pixel(int x, int y) const {
+        return dm_origin[x * dm_stepx + y * dm_stepy];
+    }
+
+    /// the pixel (0,0), pixel(x,y) being origin()[x*stepX() + y*stepY()]
+    const QRgb *origin(void) const { return dm_origin; }
+    ptrdiff_t stepX(void) const { return dm_stepx; }
+    ptrdiff_t stepY(void) const { return dm_stepy; }
+
+  private:
+    const QRgb *dm_origin;
+    ptrdiff_t dm_stepx, dm_stepy;
+    int dm_width, dm_height;
+};
+
+/**
+ * Rotates a 32-bit image by 90 degree steps, in tiles.
+ *
+ * @author Aleksander Demko
+ */
+class RotateAlg : public ImageAlg {
+  public:
+    // src must be RotatedView::canView() able
+    RotateAlg(const QImage &src, int rotatecode);
+
+    QImage &output(void) { return dm_output; }
+
+  protected:
+    virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "RotateAlg"; }
+
+    virtual QSize tileSize(void) const { return QSize(TILE_SIZE, TILE_SIZE); }
+
+    virtual void process(size_t y, size_t numrows);
+    virtual void processTile(const QRect &tile);
+
+  protected:
+    static const int TILE_SIZE = 64;
+
+    RotatedView dm_view;
+
+    QImage dm_output;
+};
+
 /**
  * The texturemapping algorithm for ClipOp
  *
@@ -54,20 +163,44 @@ class ClipAlg : public ImageAlg {
     typedef std::array<QPointF, 4> PointFArray;
     typedef std::array<QPoint, 4> PointArray;
 
+    /// how the output rectangle is mapped onto the corners
+    enum {
+        QUAD_MAPPING = 0,    // interpolated along the edges (InterClipAlg)
+        PERSPECTIVE_MAPPING, // a true perspective one (PerspectiveClipAlg)
+    };
+
   public:
     // the corners must be "sorted" via ClipOp::rearrange()
     ClipAlg(const QImage &src, const PointFArray &corners);
 
     void resizeOutputByMax(QSize maxsize);
 
+    /**
+     * Converts the (0..1) corners into pixel corners within an image of the
+     * given size, and returns the natural output size for them.
+     *
+     * @author Aleksander Demko
+     */
+    static QSize computePixCorners(QSize srcsize, const PointFArray &corners,
+                                   PointArray &pixcorners);
+
     QImage &output(void) { return dm_output; }
 
   protected:
     virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "ClipAlg"; }
+
+    // the source pixels of a tile are sampled from a small area of dm_src,
+    // where as a full row band can cut diagonally across all of it
+    virtual QSize tileSize(void) const { return QSize(TILE_SIZE, TILE_SIZE); }
 
     virtual void process(size_t y, size_t numrows);
+    virtual void processTile(const QRect &tile);
 
   protected:
+    static const int TILE_SIZE = 64;
+
     const QImage &dm_src;
     const PointFArray &dm_corners;
 
@@ -78,6 +211,9 @@ class ClipAlg : public ImageAlg {
 /**
  * Same as ClipAlg, but using bilinear interpolation.
  *
+ * For 32-bit sources, the rows are stepped through in fixed point, via
+ * PixelKernels::bilinearRow.
+ *
  * @author Aleksander Demko
  */
 class InterClipAlg : public ClipAlg {
@@ -85,12 +221,151 @@ class InterClipAlg : public ClipAlg {
     // the corners must be "sorted" via ClipOp::rearrange()
     InterClipAlg(const QImage &src, const PointFArray &corners);
 
+    /**
+     * Clips the base of the given pyramid, but samples from the pyramid
+     * level that best matches the output's footprint (how many source pixels
+     * apart neighbouring output pixels are). This avoids aliasing (and
+     * touching every source pixel) when the output is much smaller
+     * than the source, such as for previews.
+     *
+     * One level is used for the whole output, that of its largest footprint,
+     * so that (on trapezoid pages) neighbouring tiles don't differ in
+     * sharpness. The needed levels are built by run().
+     *
+     * @author Aleksander Demko
+     */
+    InterClipAlg(ImagePyramid &pyramid, const PointFArray &corners);
+
+  protected:
+    virtual const char *name(void) const { return "InterClipAlg"; }
+
+    virtual void beginRun(int numworkers);
+
+    virtual void processTile(const QRect &tile);
+
+    /// maps an output pixel into the source
+    QPointF mapPoint(int x, int y) const;
+    /// the footprint around the given output pixel
+    double footprint(int x, int y) const;
+    /// the pyramid level for the given footprint, capped to dm_maxlevel
+    int footprintLevel(double footprint) const;
+
+  protected:
+    ImagePyramid *dm_pyramid; // may be null
+    int dm_maxlevel;
+    int dm_level; // the level sampled from, set by beginRun()
+};
+
+/**
+ * Same as InterClipAlg, but the output is mapped onto the corners by a true
+ * perspective mapping (a homography), rather than by interpolating along the
+ * edges, so that evenly spaced lines on a photographed page stay evenly
+ * spaced.
+ *
+ * @author Aleksander Demko
+ */
+class PerspectiveClipAlg : public ClipAlg {
+  public:
+    /**
+     * The 3x3 matrix (the last entry being 1) that maps the unit square
+     * (u,v) onto a quad:
+     *   x = (h[0]*u + h[1]*v + h[2]) / (h[6]*u + h[7]*v + 1)
+     *   y = (h[3]*u + h[4]*v + h[5]) / (h[6]*u + h[7]*v + 1)
+     *
+     * @author Aleksander Demko
+     */
+    typedef std::array<double, 8> Homography;
+
+  public:
+    // the corners must be "sorted" via ClipOp::rearrange()
+    PerspectiveClipAlg(const QImage &src, const PointFArray &corners);
+
+    /// solves for the homography that maps the unit square onto the corners
+    static void computeHomography(const PointArray &pixcorners, Homography &h);
+
+  protected:
+    virtual const char *name(void) const { return "PerspectiveClipAlg"; }
+
+    virtual void processTile(const QRect &tile);
+
+  protected:
+    Homography dm_homography;
+};
+
+/**
+ * Halves an image, each output pixel being the average of a 2x2 block
+ * of source pixels (the last row and column are repeated for odd sizes).
+ *
+ * The output is RGB32 or ARGB32.
+ *
+ * @author Aleksander Demko
+ */
+class HalveAlg : public ImageAlg {
+  public:
+    HalveAlg(const QImage &src);
+
+    QImage &output(void) { return dm_output; }
+
   protected:
+    virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "HalveAlg"; }
+
     virtual void process(size_t y, size_t numrows);
+
+  protected:
+    const QImage &dm_src;
+
+    QImage dm_output;
+};
+
+/**
+ * Shrinks an image to any (smaller) size, each output pixel being the
+ * area weighted average of the source pixels it covers (a box filter).
+ * Growing works too, but is just nearest neighbour.
+ *
+ * The output is RGB32 or ARGB32.
+ *
+ * @author Aleksander Demko
+ */
+class ScaleAlg : public ImageAlg {
+  public:
+    ScaleAlg(const QImage &src, const QSize &outsize);
+
+    QImage &output(void) { return dm_output; }
+
+  protected:
+    virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "ScaleAlg"; }
+
+    virtual void process(size_t y, size_t numrows);
+
+  protected:
+    /// a source pixel and how much of an output pixel it makes up
+    struct Tap {
+        int pos;
+        float weight;
+    };
+    typedef std::vector<Tap> TapList;
+
+    /// taps for each output pixel along one axis, with starts[i] being
+    /// the first tap of output pixel i (and starts having one extra)
+    static void computeTaps(int srclen, int outlen, TapList &taps,
+                            std::vector<int> &starts);
+
+  protected:
+    QImage dm_src; // converted to a kernel format, if needed
+
+    TapList dm_xtaps, dm_ytaps;
+    std::vector<int> dm_xstarts, dm_ystarts;
+
+    QImage dm_output;
 };
 
 /**
  * Computes histo grams.
+ * All the channels are computed in one pass.
  *
  * @author Aleksander Demko
  */
@@ -99,28 +374,55 @@ class HistoAlg : public ImageAlg {
     static const int SIZE = 256;
     static const int HISTO_FACTOR = 256 / SIZE;
 
+    enum {
+        VALUE_CHANNEL = 0, // the hsv value, max(r,g,b)
+        RED_CHANNEL,
+        GREEN_CHANNEL,
+        BLUE_CHANNEL,
+        LUMA_CHANNEL, // qGray()
+        NUM_CHANNELS,
+    };
+
     typedef std::array<int, SIZE> HistoArray;
+    typedef std::array<HistoArray, NUM_CHANNELS> ChannelArray;
+    typedef std::array<int, NUM_CHANNELS> MaxArray;
 
   public:
     HistoAlg(const QImage &src);
 
-    HistoArray &countArray(void) { return dm_count; }
-    const HistoArray &countArray(void) const { return dm_count; }
+    HistoArray &countArray(int channel = VALUE_CHANNEL) {
+        return dm_count[channel];
+    }
+    const HistoArray &countArray(int channel = VALUE_CHANNEL) const {
+        return dm_count[channel];
+    }
+
+    ChannelArray &channels(void) { return dm_count; }
+    const ChannelArray &channels(void) const { return dm_count; }
 
-    int countMax(void) const { return dm_countmax; }
+    int countMax(int channel = VALUE_CHANNEL) const {
+        return dm_countmax[channel];
+    }
+    const MaxArray &countMaxes(void) const { return dm_countmax; }
 
   protected:
     virtual size_t height(void) const { return dm_src.height(); }
+    virtual size_t width(void) const { return dm_src.width(); }
+    virtual const char *name(void) const { return "HistoAlg"; }
+
+    virtual void beginRun(int numworkers);
+    virtual void endRun(void);
 
     virtual void process(size_t y, size_t numrows);
 
   protected:
     const QImage &dm_src;
 
-    HistoArray dm_count;
-    int dm_countmax;
+    ChannelArray dm_count;
+    MaxArray dm_countmax;
 
-    QMutex dm_outputmutex;
+    // each worker counts into its own arrays, which are summed by endRun()
+    std::vector<ChannelArray> dm_workercounts;
 };
 
 /**
@@ -144,6 +446,8 @@ class OldLevelAlg : public ImageAlg {
 
   protected:
     virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "OldLevelAlg"; }
 
     virtual void process(size_t ystart, size_t numrows);
 
@@ -151,6 +455,8 @@ class OldLevelAlg : public ImageAlg {
     const QImage &dm_src;
 
     MarkArray dm_marks;
+    // the output value of each hsv value
+    std::array<int, WHITE + 1> dm_valuetable;
 
     QImage dm_output;
 };
@@ -168,6 +474,8 @@ class NewLevelAlg : public ImageAlg {
 
     typedef std::array<int, 3> MarkArray;
     typedef std::array<int, 2> RangeArray;
+    /// the output value of every possible channel value
+    typedef std::array<uchar, WHITE + 1> ChannelTable;
 
   public:
     /**
@@ -178,26 +486,100 @@ class NewLevelAlg : public ImageAlg {
     NewLevelAlg(const QImage &src, const MarkArray &marks,
                 const RangeArray &range);
 
+    /**
+     * Same as above, but with a ready made computeChannelTable() table.
+     *
+     * @author Aleksander Demko
+     */
+    NewLevelAlg(const QImage &src, const ChannelTable &table);
+
     QImage &output(void) { return dm_output; }
 
+    /**
+     * Fills in the output value of every channel value for the given marks
+     * and range.
+     *
+     * @author Aleksander Demko
+     */
+    static void computeChannelTable(const MarkArray &marks,
+                                    const RangeArray &range,
+                                    ChannelTable &table);
+
   protected:
     virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "NewLevelAlg"; }
 
     virtual void process(size_t ystart, size_t numrows);
 
-    inline int capChannel(int col);
+    static inline int capChannel(int col, const MarkArray &marks,
+                                 const RangeArray &range);
 
   protected:
     const QImage &dm_src;
 
-    MarkArray dm_marks;
-    RangeArray dm_range;
+    ChannelTable dm_table;
+    PixelKernels::LevelTable dm_leveltable;
 
     QImage dm_output;
 };
 
 typedef NewLevelAlg LevelAlg;
 
+/**
+ * The whole TransformOp, ClipOp and LevelOp chain in one pass.
+ * Each output pixel is sampled straight out of the unrotated source and then
+ * leveled, so only the output image is ever allocated.
+ *
+ * The output is the same as running RotateAlg, InterClipAlg (or
+ * PerspectiveClipAlg) and NewLevelAlg one after the other.
+ *
+ * @author Aleksander Demko
+ */
+class PageAlg : public ImageAlg {
+  public:
+    /**
+     * corners (sorted via ClipOp::rearrange()) may be null for no clipping,
+     * table may be null for no leveling.
+     * mapping is one of the ClipAlg mappings.
+     * src must be canRender() able.
+     *
+     * @author Aleksander Demko
+     */
+    PageAlg(const QImage &src, int rotatecode,
+            const ClipAlg::PointFArray *corners,
+            const NewLevelAlg::ChannelTable *table,
+            int mapping = ClipAlg::QUAD_MAPPING);
+
+    /// is the given image in a format that this alg can work on?
+    static bool canRender(const QImage &src);
+
+    QImage &output(void) { return dm_output; }
+
+  protected:
+    virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "PageAlg"; }
+
+    virtual QSize tileSize(void) const { return QSize(TILE_SIZE, TILE_SIZE); }
+
+    virtual void process(size_t y, size_t numrows);
+    virtual void processTile(const QRect &tile);
+
+  protected:
+    static const int TILE_SIZE = 64;
+
+    RotatedView dm_view;
+
+    bool dm_clip, dm_perspective;
+    ClipAlg::PointArray dm_pix_corners;
+    PerspectiveClipAlg::Homography dm_homography;
+
+    const NewLevelAlg::ChannelTable *dm_table;
+
+    QImage dm_output;
+};
+
 /*class WhiteThreshAlg : public ImageAlg
 {
   public:
@@ -235,6 +617,8 @@ class ThresholdAlg : public ImageAlg {
 
   protected:
     virtual size_t height(void) const { return dm_output.height(); }
+    virtual size_t width(void) const { return dm_output.width(); }
+    virtual const char *name(void) const { return "ThresholdAlg"; }
 
   protected:
     const QImage &dm_src;
@@ -286,4 +670,23 @@ template <class FUNC> class GenericThresholdAlg : public ThresholdAlg {
     FUNC dm_func;
 };
 
+/**
+ * The same as a GenericThresholdAlg with a (r + g + b) / 3 > thres
+ * function, but with PixelKernels.
+ *
+ * @author Aleksander Demko
+ */
+class AvgThresholdAlg : public ThresholdAlg {
+  public:
+    AvgThresholdAlg(const QImage &src, int thres);
+
+  protected:
+    virtual const char *name(void) const { return "AvgThresholdAlg"; }
+
+    virtual void process(size_t ystart, size_t numrows);
+
+  protected:
+    int dm_thres;
+};
+
 #endif
@@ -7,9 +7,29 @@
 
 #include <ImageFileCache.h>
 
+#include <assert.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
 #include <QDebug>
+#include <QImageReader>
 #include <QPixmap>
 
+#include <DiskCache.h>
+#include <Stats.h>
+#include <Trace.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#include <sys/types.h>
+#else
+#include <unistd.h>
+#endif
+
 QSize calcAspect(const QSize &current, const QSize &wantedFrame,
                  bool growtofit) {
     unsigned long C, R, WC, WR, c, r;
@@ -96,7 +116,343 @@ QSize calcAspectEven(const QSize &current, const QSize &wantedFrame,
 //
 //
 
-ImageFileCache::ImageFileCache(int maxhold) : dm_cache(maxhold) {}
+const double ImageFileCache::DEFAULT_RAM_FRACTION = 0.25;
+
+// never go below this, whatever the machine claims
+static const qint64 MIN_MAX_BYTES = 256 * 1024 * 1024;
+
+// the DiskCache item of a preview at the given level
+static QString previewItem(int level) {
+    return "preview " + QString::number(level);
+}
+
+ImageFileCache::ImageFileCache(qint64 maxbytes)
+    : dm_maxbytes(maxbytes > 0 ? maxbytes : defaultMaxBytes()), dm_clock(0),
+      dm_diskcache(0), dm_hits(0), dm_misses(0), dm_waits(0), dm_prefetches(0),
+      dm_prefetchhits(0) {}
+
+void ImageFileCache::setMaxBytes(qint64 maxbytes) {
+    QMutexLocker L(&dm_lock);
+
+    dm_maxbytes = maxbytes > 0 ? maxbytes : defaultMaxBytes();
+    trim();
+}
+
+qint64 ImageFileCache::byteCount(void) const {
+    QMutexLocker L(&dm_lock);
+    qint64 total = 0;
+
+    for (EntryList::const_iterator ii = dm_entries.begin();
+         ii != dm_entries.end(); ++ii)
+        total += ii->pyramid->byteCount();
+
+    return total;
+}
+
+qint64 ImageFileCache::defaultMaxBytes(double fraction) {
+    const char *mb = getenv("POCKETSCAN_CACHE_MB");
+
+    if (mb && atoll(mb) > 0)
+        return static_cast<qint64>(atoll(mb)) * 1024 * 1024;
+
+    return std::max(MIN_MAX_BYTES,
+                    static_cast<qint64>(physicalMemory() * fraction));
+}
+
+qint64 ImageFileCache::physicalMemory(void) {
+#if defined(_WIN32)
+    MEMORYSTATUSEX status;
+
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return static_cast<qint64>(status.ullTotalPhys);
+#elif defined(__APPLE__)
+    int mib[2] = {CTL_HW, HW_MEMSIZE};
+    int64_t mem = 0;
+    size_t len = sizeof(mem);
+
+    if (sysctl(mib, 2, &mem, &len, 0, 0) == 0 && mem > 0)
+        return mem;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGE_SIZE);
+
+    if (pages > 0 && pagesize > 0)
+        return static_cast<qint64>(pages) * pagesize;
+#endif
+    // no idea, assume a modest machine
+    return static_cast<qint64>(2) * 1024 * 1024 * 1024;
+}
+
+void ImageFileCache::pin(const QString &fullfilename) {
+    QMutexLocker L(&dm_lock);
+
+    dm_pins[fullfilename]++;
+}
+
+void ImageFileCache::unpin(const QString &fullfilename) {
+    QMutexLocker L(&dm_lock);
+    QHash<QString, int>::iterator ii = dm_pins.find(fullfilename);
+
+    assert(ii != dm_pins.end());
+
+    if (--ii.value() <= 0)
+        dm_pins.erase(ii);
+
+    trim();
+}
+
+void ImageFileCache::trim(void) {
+    qint64 total = 0;
+
+    for (EntryList::const_iterator ii = dm_entries.begin();
+         ii != dm_entries.end(); ++ii)
+        total += ii->pyramid->byteCount();
+
+    while (total > dm_maxbytes) {
+        EntryList::iterator victim = dm_entries.end();
+        double victimscore = 0;
+
+        // never evict the most recently used one, as the caller is probably
+        // still working with it
+        for (EntryList::iterator ii = ++dm_entries.begin();
+             ii != dm_entries.end(); ++ii) {
+            if (dm_pins.contains(ii->fileName))
+                continue;
+
+            double score = static_cast<double>(dm_clock - ii->lastuse + 1) *
+                           ii->pyramid->byteCount();
+
+            if (victim == dm_entries.end() || score > victimscore) {
+                victim = ii;
+                victimscore = score;
+            }
+        }
+
+        if (victim == dm_entries.end())
+            break; // everything left is pinned (or in use)
+
+        total -= victim->pyramid->byteCount();
+        dm_entries.erase(victim);
+        Stats::add("filecache.evictions");
+    }
+
+    Stats::set("filecache.bytes", total);
+}
+
+bool ImageFileCache::hasImage(const QString &fullfilename) const {
+    QMutexLocker L(&dm_lock);
+
+    for (EntryList::const_iterator ii = dm_entries.begin();
+         ii != dm_entries.end(); ++ii)
+        if (ii->fileName == fullfilename)
+            return true;
+
+    return false;
+}
+
+ImageFileCache::EntryList::iterator
+ImageFileCache::findEntry(const QString &fullfilename) {
+    EntryList::iterator ii;
+
+    for (ii = dm_entries.begin(); ii != dm_entries.end(); ++ii)
+        if (ii->fileName == fullfilename)
+            break;
+
+    return ii;
+}
+
+ImageFileCache::Entry &ImageFileCache::getEntry(QMutexLocker &L,
+                                                const QString &fullfilename,
+                                                int level) {
+    // single flight: wait out anyone else loading the file, as that may
+    // well be what we need
+    while (dm_loading.contains(fullfilename)) {
+        TRACE_SCOPE("ImageFileCache wait");
+
+        dm_waits++;
+        Stats::add("filecache.waits");
+        dm_loaded.wait(&dm_lock);
+    }
+
+    EntryList::iterator ii = findEntry(fullfilename);
+
+    if (ii != dm_entries.end() && ii->baselevel <= level) {
+        dm_hits++;
+        Stats::add("filecache.hits");
+        if (ii->prefetched) {
+            dm_prefetchhits++;
+            Stats::add("filecache.prefetch_hits");
+        }
+        // move it to the front
+        dm_entries.splice(dm_entries.begin(), dm_entries, ii);
+    } else {
+        dm_misses++;
+        Stats::add("filecache.misses");
+        loadFront(L, fullfilename, level);
+    }
+
+    dm_entries.front().lastuse = ++dm_clock;
+    dm_entries.front().prefetched = false;
+
+    return dm_entries.front();
+}
+
+void ImageFileCache::loadFront(QMutexLocker &L, const QString &fullfilename,
+                               int level) {
+    Entry entry;
+
+    entry.fileName = fullfilename;
+
+    // decode without the lock, anyone else wanting the file waits on
+    // dm_loaded
+    dm_loading.insert(fullfilename);
+    L.unlock();
+
+    loadEntry(entry, level);
+
+    L.relock();
+    dm_loading.remove(fullfilename);
+    dm_loaded.wakeAll();
+
+    // replaces any coarser one
+    EntryList::iterator ii = findEntry(fullfilename);
+
+    if (ii != dm_entries.end())
+        dm_entries.erase(ii);
+
+    entry.lastuse = ++dm_clock;
+    dm_entries.push_front(entry);
+}
+
+std::shared_ptr<ImagePyramid>
+ImageFileCache::getPyramid(const QString &fullfilename) {
+    QMutexLocker L(&dm_lock);
+    std::shared_ptr<ImagePyramid> ret(getEntry(L, fullfilename, 0).pyramid);
+
+    trim();
+
+    return ret;
+}
+
+std::shared_ptr<QImage> ImageFileCache::getImage(const QString &fullfilename) {
+    return std::shared_ptr<QImage>(
+        new QImage(getPyramid(fullfilename)->base()));
+}
+
+std::shared_ptr<QImage> ImageFileCache::getImage(const QString &fullfilename,
+                                                 QSize wantedSize) {
+    if (!wantedSize.isValid())
+        return getImage(fullfilename);
+
+    int level = ImagePyramid::levelFor(imageSize(fullfilename), wantedSize);
+    QMutexLocker L(&dm_lock);
+    Entry &entry = getEntry(L, fullfilename, level);
+    // (entry may go away while unlocked, but not the pyramid)
+    std::shared_ptr<ImagePyramid> pyramid(entry.pyramid);
+    int l = std::min(std::max(0, level - entry.baselevel), pyramid->maxLevel());
+    int from = pyramid->levelCount();
+
+    if (from <= l) {
+        // build the missing levels without the lock, as for a load (single
+        // flight), so that the rest of the cache isnt held up by it
+        TRACE_SCOPE("ImageFileCache levels");
+        QImage last(pyramid->level(from - 1));
+        std::vector<QImage> levels;
+
+        dm_loading.insert(fullfilename);
+        L.unlock();
+
+        ImagePyramid::buildLevels(last, l + 1 - from, levels);
+
+        L.relock();
+        dm_loading.remove(fullfilename);
+        dm_loaded.wakeAll();
+
+        pyramid->appendLevels(from, levels);
+    }
+
+    std::shared_ptr<QImage> ret(new QImage(pyramid->level(l)));
+
+    // a new level might have been built
+    trim();
+
+    return ret;
+}
+
+bool ImageFileCache::prefetch(const QString &fullfilename, QSize wantedSize) {
+    int level = 0;
+
+    if (wantedSize.isValid())
+        level = ImagePyramid::levelFor(imageSize(fullfilename), wantedSize);
+
+    QMutexLocker L(&dm_lock);
+
+    // someone is already on it
+    if (dm_loading.contains(fullfilename))
+        return false;
+
+    EntryList::iterator ii = findEntry(fullfilename);
+
+    if (ii != dm_entries.end() && ii->baselevel <= level)
+        return false;
+
+    loadFront(L, fullfilename, level);
+    dm_entries.front().prefetched = true;
+    dm_prefetches++;
+    Stats::add("filecache.prefetches");
+
+    trim();
+
+    return true;
+}
+
+int ImageFileCache::prefetchCount(void) const {
+    QMutexLocker L(&dm_lock);
+
+    return dm_prefetches;
+}
+
+int ImageFileCache::prefetchHitCount(void) const {
+    QMutexLocker L(&dm_lock);
+
+    return dm_prefetchhits;
+}
+
+int ImageFileCache::hitCount(void) const {
+    QMutexLocker L(&dm_lock);
+
+    return dm_hits;
+}
+
+int ImageFileCache::missCount(void) const {
+    QMutexLocker L(&dm_lock);
+
+    return dm_misses;
+}
+
+int ImageFileCache::waitCount(void) const {
+    QMutexLocker L(&dm_lock);
+
+    return dm_waits;
+}
+
+QSize ImageFileCache::imageSize(const QString &fullfilename) {
+    {
+        QMutexLocker L(&dm_lock);
+        EntryList::iterator ii = findEntry(fullfilename);
+
+        if (ii != dm_entries.end())
+            return ii->fullsize;
+    }
+
+    QSize s(QImageReader(fullfilename).size());
+
+    if (s.isValid())
+        return s;
+
+    return getPyramid(fullfilename)->base().size();
+}
 
 QPixmap ImageFileCache::getPixmap(QImage &image, int windoww, int windowh,
                                   bool growtofit) {
@@ -111,20 +467,64 @@ QPixmap ImageFileCache::getPixmap(QImage &image, int windoww, int windowh,
     return QPixmap::fromImage(scaled_image);
 }
 
-std::shared_ptr<QImage>
-ImageFileCache::ImageLoader::operator()(const QString &fullfilename) {
-    std::shared_ptr<QImage> i(new QImage);
-    bool ok = i->load(fullfilename);
+void ImageFileCache::loadEntry(Entry &entry, int level) {
+    TRACE_SCOPE("ImageFileCache load");
+    StatsTimer timer("filecache.load_ms");
+    QImageReader reader(entry.fileName);
+    QImage i;
+
+    entry.fullsize = reader.size();
+    entry.baselevel = 0;
+    entry.prefetched = false;
+
+    if (level > MAX_DECODE_LEVEL)
+        level = MAX_DECODE_LEVEL;
+
+    // a preview from an earlier run, at least as fine as wanted?
+    if (dm_diskcache && entry.fullsize.isValid())
+        for (int l = level; l > 0; --l) {
+            QImage preview;
+
+            if (dm_diskcache->loadImage(entry.fileName, previewItem(l),
+                                        preview) &&
+                preview.size() == ImagePyramid::levelSize(entry.fullsize, l)) {
+                entry.baselevel = l;
+                entry.pyramid.reset(new ImagePyramid(preview));
+                return;
+            }
+        }
+
+    if (level > 0 && entry.fullsize.isValid() &&
+        reader.supportsOption(QImageIOHandler::ScaledSize)) {
+        // exactly the pyramid level size, so that JPEG can do it all
+        // in the DCT domain
+        reader.setScaledSize(ImagePyramid::levelSize(entry.fullsize, level));
+        entry.baselevel = level;
+    }
+
+    bool ok = reader.read(&i);
 
     /*
     if (ok)
-      *i = hydra::rotateImageExif(hydra::detectExifRotate(fullfilename), *i);
+      i = hydra::rotateImageExif(hydra::detectExifRotate(entry.fileName), i);
     else
-      *i = QImage();
+      i = QImage();
     */
 
-    if (!ok)
-        *i = QImage();
+    if (!ok) {
+        i = QImage();
+        entry.baselevel = 0;
+    }
+    if (!entry.fullsize.isValid())
+        entry.fullsize = i.size();
+
+    entry.pyramid.reset(new ImagePyramid(i));
 
-    return i;
+    if (ok && level > 0 && dm_diskcache) {
+        const QImage &preview(entry.pyramid->level(level - entry.baselevel));
+
+        if (preview.size() == ImagePyramid::levelSize(entry.fullsize, level))
+            dm_diskcache->storeImage(entry.fileName, previewItem(level),
+                                     preview);
+    }
 }
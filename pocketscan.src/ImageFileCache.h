@@ -8,9 +8,17 @@
 #ifndef __INCLUDED_IMAGEFILECACHE_H__
 #define __INCLUDED_IMAGEFILECACHE_H__
 
+#include <list>
+
+#include <QHash>
 #include <QImage>
+#include <QMutex>
+#include <QSet>
+#include <QWaitCondition>
+
+#include <hydra/TR1.h>
 
-#include <desktop/LoadCache.h>
+#include <ImagePyramid.h>
 
 QSize calcAspect(const QSize &current, const QSize &wantedFrame,
                  bool growtofit);
@@ -24,26 +32,93 @@ QSize calcAspectEven(const QSize &current, const QSize &wantedFrame,
                      bool growtofit);
 
 class ImageFileCache;
+class DiskCache;
 
 /**
- * A image-reading cache, useful for the big image viewers. Also does rescaling
- * of the image as needed. The rescaled versions however are not cached.
+ * A image-reading cache, useful for the big image viewers.
+ *
+ * Each file is kept as an ImagePyramid, so the smaller (1/2, 1/4, 1/8...)
+ * versions of it are built once, as they are asked for, and then
+ * cached with it.
+ *
+ * The cache is bounded by the total bytes of the decoded images. When over
+ * budget, the unpinned file with the largest (age * bytes) is dropped
+ * first, so that one big old image goes before several small recent ones.
+ *
+ * All the functions are thread safe (but the returned pyramids themselves
+ * are not). Decodes, and the building of any missing pyramid levels, are
+ * done without holding the cache's lock and are single flight: while one
+ * thread is loading a file, any others that want it wait for (and then
+ * share) that load rather than decoding it again.
+ * Files can also be prefetch()ed from background threads
+ * (see ImagePrefetcher).
+ *
+ * Reduced decodes can also be kept between runs in a DiskCache.
  *
  * @author Aleksander Demko
  */
 class ImageFileCache {
   public:
-    /// constructor
-    ImageFileCache(int maxhold = 10);
+    /**
+     * Constructor. maxbytes is the budget, 0 meaning defaultMaxBytes().
+     *
+     * @author Aleksander Demko
+     */
+    ImageFileCache(qint64 maxbytes = 0);
+
+    /**
+     * Sets the DiskCache that reduced decodes are kept in and first looked
+     * for in. It is not owned. Must be set before the cache is used, if
+     * at all.
+     *
+     * @author Aleksander Demko
+     */
+    void setDiskCache(DiskCache *diskcache) { dm_diskcache = diskcache; }
+
+    qint64 maxBytes(void) const { return dm_maxbytes; }
+    void setMaxBytes(qint64 maxbytes);
+
+    /// the bytes currently held
+    qint64 byteCount(void) const;
+
+    /**
+     * The default budget: the POCKETSCAN_CACHE_MB environment variable if
+     * set, otherwise the given fraction of physicalMemory().
+     *
+     * @author Aleksander Demko
+     */
+    static qint64 defaultMaxBytes(double fraction = DEFAULT_RAM_FRACTION);
+
+    /// the physical memory of the machine, or a guess if it can't be found
+    static qint64 physicalMemory(void);
+
+    static const double DEFAULT_RAM_FRACTION;
+
+    /**
+     * Pins the given file, so that it wont be evicted (even if that means
+     * going over budget) until unpin()ed. Pins are counted, and the file
+     * doesn't have to be loaded yet.
+     *
+     * @author Aleksander Demko
+     */
+    void pin(const QString &fullfilename);
+    void unpin(const QString &fullfilename);
 
     /**
      * Is the given fullfilename in the cache?
      *
      * @author Aleksander Demko
      */
-    bool hasImage(const QString &fullfilename) const {
-        return dm_cache.containsItem(fullfilename);
-    }
+    bool hasImage(const QString &fullfilename) const;
+
+    /**
+     * Loads the given file as an image pyramid, from cache if possible.
+     * This function never fails and never returns null - on error, the
+     * pyramid will be of an empty image.
+     *
+     * @author Aleksander Demko
+     */
+    std::shared_ptr<ImagePyramid> getPyramid(const QString &fullfilename);
 
     /**
      * Loads the given file as an image, from cache if possible.
@@ -52,21 +127,113 @@ class ImageFileCache {
      *
      * @author Aleksander Demko
      */
-    desktop::cache_ptr<QImage> getImage(const QString &fullfilename) {
-        return dm_cache.getItem(fullfilename);
-    }
+    std::shared_ptr<QImage> getImage(const QString &fullfilename);
+
+    /**
+     * Same as above, but returns the smallest level of the file's
+     * pyramid that is still at least wantedSize big (see
+     * ImagePyramid::levelFor), which may be the full image.
+     *
+     * If the file isn't cached (at a fine enough level), and its codec can
+     * do it (JPEG), it is only decoded at the reduced size (down to
+     * 1/2^MAX_DECODE_LEVEL, via QImageReader::setScaledSize, which JPEG
+     * does in the DCT domain). Only getPyramid() and getImage(filename)
+     * always decode the full image.
+     *
+     * @author Aleksander Demko
+     */
+    std::shared_ptr<QImage> getImage(const QString &fullfilename,
+                                     QSize wantedSize);
+
+    /**
+     * Decodes the given file into the cache, as getImage(fullfilename,
+     * wantedSize) would, unless its already there (or being loaded). This
+     * is meant to be called from background threads.
+     *
+     * Returns true if the file was actually loaded.
+     *
+     * @author Aleksander Demko
+     */
+    bool prefetch(const QString &fullfilename, QSize wantedSize);
+
+    /// the number of files loaded by prefetch()
+    int prefetchCount(void) const;
+    /// how many of those were then asked for (before being evicted)
+    int prefetchHitCount(void) const;
+
+    /// the get*() requests that were already in the cache
+    int hitCount(void) const;
+    /// the get*() requests that had to decode
+    int missCount(void) const;
+    /// the times a request waited for another thread's decode
+    int waitCount(void) const;
+
+    /// the full size of the given file, read from its header if need be
+    QSize imageSize(const QString &fullfilename);
+
+    /// the most reduced decode that getImage(filename, size) will do
+    static const int MAX_DECODE_LEVEL = 3;
 
     static QPixmap getPixmap(QImage &image, int windoww, int windowh,
                              bool growtofit);
 
   private:
-    class ImageLoader {
-      public:
-        // never returns null... failed loads will simply be empty images
-        std::shared_ptr<QImage> operator()(const QString &fullfilename);
+    struct Entry {
+        QString fileName;
+        std::shared_ptr<ImagePyramid> pyramid;
+        // the pyramid's base is this level of the full image pyramid,
+        // non-zero for reduced decodes
+        int baselevel;
+        QSize fullsize;
+        quint64 lastuse; // dm_clock at the last use
+        bool prefetched; // loaded by prefetch() and not yet asked for
     };
 
-    desktop::LoadCache<QImage, ImageLoader> dm_cache;
+    typedef std::list<Entry> EntryList;
+
+  private:
+    // these all assume dm_lock is held
+
+    EntryList::iterator findEntry(const QString &fullfilename);
+
+    /**
+     * Returns the entry of the file, moved to the front. It is (re)loaded if
+     * its not in the cache or if its base is coarser than the given level.
+     * The caller should trim() once done with it.
+     * L (of dm_lock) is released while waiting for or doing the load.
+     *
+     * @author Aleksander Demko
+     */
+    Entry &getEntry(QMutexLocker &L, const QString &fullfilename, int level);
+
+    // loads the file with L released (in dm_loading while doing so),
+    // and puts it in the front, replacing any previous entry
+    void loadFront(QMutexLocker &L, const QString &fullfilename, int level);
+
+    // fills in the pyramid, decoding the file at (up to) the given level
+    // (or loading that from the disk cache)
+    // failed loads will simply be empty images
+    // doesn't need the lock
+    void loadEntry(Entry &entry, int level);
+
+    /// evicts files until within budget
+    void trim(void);
+
+  private:
+    mutable QMutex dm_lock;
+    QWaitCondition dm_loaded; // signalled when a load finishes
+    QSet<QString> dm_loading; // the files being loaded
+
+    qint64 dm_maxbytes;
+    quint64 dm_clock;
+    EntryList dm_entries; // the most recently used first
+
+    QHash<QString, int> dm_pins;
+
+    DiskCache *dm_diskcache;
+
+    int dm_hits, dm_misses, dm_waits;
+    int dm_prefetches, dm_prefetchhits;
 };
 
 #endif
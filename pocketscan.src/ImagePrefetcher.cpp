@@ -0,0 +1,70 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <ImagePrefetcher.h>
+
+#include <algorithm>
+
+#include <QRunnable>
+#include <QThread>
+
+#include <ImageFileCache.h>
+#include <Trace.h>
+
+class ImagePrefetcher::Runner : public QRunnable {
+  public:
+    Runner(ImagePrefetcher *parent, const Job &job, int generation)
+        : dm_parent(parent), dm_job(job), dm_generation(generation) {}
+
+    virtual void run(void) {
+        if (dm_parent->dm_generation.load() != dm_generation)
+            return; // stale
+
+        TRACE_SCOPE("prefetch");
+        ImageFileCache &cache = dm_parent->dm_cache;
+        QSize wanted;
+
+        if (dm_job.wantedSize)
+            wanted = dm_job.wantedSize(cache.imageSize(dm_job.fileName));
+
+        cache.prefetch(dm_job.fileName, wanted);
+    }
+
+  private:
+    ImagePrefetcher *dm_parent;
+    Job dm_job;
+    int dm_generation;
+};
+
+ImagePrefetcher::ImagePrefetcher(ImageFileCache &cache, int numthreads)
+    : dm_cache(cache) {
+    if (numthreads <= 0)
+        numthreads = std::max(
+            1, std::min(static_cast<int>(DEFAULT_THREADS),
+                        QThread::idealThreadCount() - 1));
+
+    dm_pool.setMaxThreadCount(numthreads);
+}
+
+ImagePrefetcher::~ImagePrefetcher() {
+    cancel();
+    dm_pool.waitForDone();
+}
+
+void ImagePrefetcher::prefetch(const JobList &jobs) {
+    cancel();
+
+    int generation = dm_generation.load();
+
+    for (JobList::const_iterator ii = jobs.begin(); ii != jobs.end(); ++ii)
+        dm_pool.start(new Runner(this, *ii, generation));
+}
+
+void ImagePrefetcher::cancel(void) {
+    dm_generation.ref();
+    dm_pool.clear();
+}
@@ -0,0 +1,79 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_IMAGEPREFETCHER_H__
+#define __INCLUDED_POCKETSCAN_IMAGEPREFETCHER_H__
+
+#include <functional>
+#include <vector>
+
+#include <QAtomicInt>
+#include <QSize>
+#include <QString>
+#include <QThreadPool>
+
+class ImageFileCache;
+
+/**
+ * Decodes files into an ImageFileCache ahead of time, on its own
+ * background threads (so that it doesn't compete with the ImageAlgs for
+ * the global pool).
+ *
+ * Each prefetch() supersedes the previous one: its queued jobs are dropped
+ * and any that are already running are left to finish.
+ *
+ * @author Aleksander Demko
+ */
+class ImagePrefetcher {
+  public:
+    /// given the full size of a file, returns the size wanted from it
+    typedef std::function<QSize(QSize)> SizeFunc;
+
+    struct Job {
+        QString fileName;
+        SizeFunc wantedSize; // empty for the full image
+
+        Job(const QString &_fileName, const SizeFunc &_wantedSize)
+            : fileName(_fileName), wantedSize(_wantedSize) {}
+    };
+
+    typedef std::vector<Job> JobList;
+
+    /**
+     * Constructor. numthreads of 0 means DEFAULT_THREADS (or less, on small
+     * machines).
+     *
+     * @author Aleksander Demko
+     */
+    ImagePrefetcher(ImageFileCache &cache, int numthreads = 0);
+    /// cancel()s and then waits for the running jobs
+    ~ImagePrefetcher();
+
+    static const int DEFAULT_THREADS = 2;
+
+    /**
+     * Replaces any queued jobs with the given ones, which are run in order
+     * (ImageFileCache::prefetch).
+     *
+     * @author Aleksander Demko
+     */
+    void prefetch(const JobList &jobs);
+
+    /// drops all the queued jobs
+    void cancel(void);
+
+  private:
+    class Runner;
+
+    ImageFileCache &dm_cache;
+    QThreadPool dm_pool;
+    // bumped by every cancel, so that stale jobs that slipped past
+    // QThreadPool::clear know to do nothing
+    QAtomicInt dm_generation;
+};
+
+#endif
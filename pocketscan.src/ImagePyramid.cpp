@@ -0,0 +1,115 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <ImagePyramid.h>
+
+#include <assert.h>
+
+#include <algorithm>
+
+#include <ImageAlg.h>
+
+ImagePyramid::ImagePyramid(void) : dm_maxlevel(0) {}
+
+ImagePyramid::ImagePyramid(const QImage &base) : dm_maxlevel(0) {
+    dm_levels.push_back(base);
+
+    QSize s(base.size());
+
+    while (s.width() > 1 && s.height() > 1) {
+        s = QSize((s.width() + 1) / 2, (s.height() + 1) / 2);
+        dm_maxlevel++;
+    }
+}
+
+const QImage &ImagePyramid::level(int l) {
+    assert(!isNull());
+    assert(l >= 0);
+
+    l = std::min(l, dm_maxlevel);
+
+    if (levelCount() <= l) {
+        std::vector<QImage> levels;
+
+        buildLevels(dm_levels.back(), l + 1 - levelCount(), levels);
+        appendLevels(levelCount(), levels);
+    }
+
+    return dm_levels[l];
+}
+
+void ImagePyramid::buildLevels(const QImage &img, int count,
+                               std::vector<QImage> &out) {
+    const QImage *last = &img;
+
+    out.clear();
+    out.reserve(count);
+
+    for (int i = 0; i < count; ++i) {
+        HalveAlg alg(*last);
+
+        alg.run();
+
+        out.push_back(alg.output());
+        last = &out.back();
+    }
+}
+
+void ImagePyramid::appendLevels(int from, const std::vector<QImage> &levels) {
+    if (from != levelCount())
+        return;
+
+    for (size_t i = 0; i < levels.size() && levelCount() <= dm_maxlevel; ++i)
+        dm_levels.push_back(levels[i]);
+}
+
+int ImagePyramid::levelFor(QSize basesize, QSize minsize) {
+    QSize s(basesize);
+    int l = 0;
+
+    while (s.width() > 1 && s.height() > 1) {
+        QSize next((s.width() + 1) / 2, (s.height() + 1) / 2);
+
+        if (next.width() < minsize.width() || next.height() < minsize.height())
+            break;
+        s = next;
+        ++l;
+    }
+
+    return l;
+}
+
+QSize ImagePyramid::levelSize(QSize basesize, int l) {
+    QSize s(basesize);
+
+    for (int i = 0; i < l; ++i)
+        s = QSize((s.width() + 1) / 2, (s.height() + 1) / 2);
+
+    return s;
+}
+
+qint64 ImagePyramid::byteCount(void) const {
+    qint64 total = 0;
+
+    for (size_t i = 0; i < dm_levels.size(); ++i)
+        total += static_cast<qint64>(dm_levels[i].bytesPerLine()) *
+                 dm_levels[i].height();
+
+    return total;
+}
+
+QPointF ImagePyramid::toLevel(const QPointF &basep, int l) const {
+    QSize s(levelSize(l));
+    double scale = 1.0 / (1 << l);
+    // the pixel centers of level l are at the centers of 2^l x 2^l
+    // blocks of base pixels
+    double x = (basep.x() + 0.5) * scale - 0.5;
+    double y = (basep.y() + 0.5) * scale - 0.5;
+
+    return QPointF(std::min(std::max(x, 0.0), s.width() - 1.0),
+                   std::min(std::max(y, 0.0), s.height() - 1.0));
+}
@@ -0,0 +1,100 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_IMAGEPYRAMID_H__
+#define __INCLUDED_POCKETSCAN_IMAGEPYRAMID_H__
+
+#include <vector>
+
+#include <QImage>
+
+/**
+ * A mip pyramid of an image: level 0 is the image itself, and each
+ * level after that is a 2x2 box filtered half of the one before it.
+ *
+ * The levels are built lazily, as they are asked for. Building is not thread
+ * safe, so ask for (or prepare()) the wanted levels before sharing
+ * the pyramid with any workers.
+ *
+ * @author Aleksander Demko
+ */
+class ImagePyramid {
+  public:
+    /// a null pyramid
+    ImagePyramid(void);
+    ImagePyramid(const QImage &base);
+
+    bool isNull(void) const { return dm_levels.empty(); }
+
+    const QImage &base(void) const { return dm_levels[0]; }
+
+    /// the highest level (the one that would be 1 pixel wide or tall)
+    int maxLevel(void) const { return dm_maxlevel; }
+
+    /// returns the given level, building it (and the ones before it) if need be
+    const QImage &level(int l);
+
+    /// makes sure that the levels 0..l are built
+    void prepare(int l) { level(l); }
+
+    /// the number of levels built so far
+    int levelCount(void) const { return static_cast<int>(dm_levels.size()); }
+
+    /**
+     * Builds the given number of levels after img (each half the one
+     * before it) into out, without touching any pyramid. Together with
+     * appendLevels(), this lets a shared pyramid be grown without locking
+     * out its readers while the halving is done.
+     *
+     * @author Aleksander Demko
+     */
+    static void buildLevels(const QImage &img, int count,
+                            std::vector<QImage> &out);
+    /**
+     * Appends levels made by buildLevels() from level from-1, unless
+     * the pyramid has changed since (then they are dropped).
+     *
+     * @author Aleksander Demko
+     */
+    void appendLevels(int from, const std::vector<QImage> &levels);
+
+    /**
+     * Returns the highest level that is still at least minsize big
+     * (in both directions), that is, the best one to scale down to minsize
+     * from.
+     *
+     * @author Aleksander Demko
+     */
+    int levelFor(QSize minsize) const {
+        return levelFor(base().size(), minsize);
+    }
+
+    /// the size of the given level, even if it isnt built yet
+    QSize levelSize(int l) const { return levelSize(base().size(), l); }
+
+    /// levelFor() of a pyramid with the given base size
+    static int levelFor(QSize basesize, QSize minsize);
+    /// levelSize() of a pyramid with the given base size
+    static QSize levelSize(QSize basesize, int l);
+
+    /// the number of bytes used by the levels built so far
+    qint64 byteCount(void) const;
+
+    /**
+     * Converts a pixel coordinate in the base into one in the given level,
+     * keeping it within the level.
+     *
+     * @author Aleksander Demko
+     */
+    QPointF toLevel(const QPointF &basep, int l) const;
+
+  private:
+    std::vector<QImage> dm_levels;
+    int dm_maxlevel;
+};
+
+#endif
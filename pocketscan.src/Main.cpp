@@ -11,18 +11,52 @@
 #include <QDirIterator>
 #include <QFileInfo>
 #include <QMessageBox>
+#include <QThreadPool>
 
+#include <Batch.h>
 #include <MainWindow.h>
+#include <Stats.h>
+#include <Trace.h>
 
-int main(int argc, char *argv[]) {
-    QApplication app(argc, argv);
-
+static void initApplication(void) {
     QCoreApplication::setOrganizationName("AlexDemko");
     QCoreApplication::setOrganizationDomain("demko.ca");
     QCoreApplication::setApplicationName("PocketScan");
+}
+
+// headless, no GUI (or display) needed
+static int batchMain(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    initApplication();
 
     QStringList args = QCoreApplication::arguments();
 
+    Trace::startFromArguments(args);
+
+    int ret = Batch::run(args);
+
+    // the image algs run on the global pool
+    QThreadPool::globalInstance()->waitForDone();
+
+    Stats::dumpAtExit();
+    Trace::stop();
+
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    if (Batch::isBatch(argc, argv))
+        return batchMain(argc, argv);
+
+    QApplication app(argc, argv);
+
+    initApplication();
+
+    QStringList args = QCoreApplication::arguments();
+
+    Trace::startFromArguments(args);
+
     MainWindow *window = new MainWindow;
 
     window->show();
@@ -51,5 +85,15 @@ int main(int argc, char *argv[]) {
         window->project().notifyChange(0);
     }
 
-    return app.exec();
+    int ret = app.exec();
+
+    // stops (and waits for) the prefetcher, and then any image algs, so that
+    // nothing is still tracing
+    delete window;
+    QThreadPool::globalInstance()->waitForDone();
+
+    Stats::dumpAtExit();
+    Trace::stop();
+
+    return ret;
 }
@@ -11,6 +11,7 @@
 #include <QDirIterator>
 #include <QDragEnterEvent>
 #include <QFileDialog>
+#include <QInputDialog>
 #include <QMenu>
 #include <QMenuBar>
 #include <QMessageBox>
@@ -18,11 +19,13 @@
 #include <QPainter>
 #include <QPrintDialog>
 #include <QPrintPreviewDialog>
+#include <QProgressDialog>
 #include <QSettings>
 #include <QUrl>
 
 #include <AboutDialog.h>
 #include <ImageAddButton.h>
+#include <Stats.h>
 #include <TabBar.h>
 #include <TileView.h>
 
@@ -165,6 +168,7 @@ MainWindow::~MainWindow() {
 void MainWindow::onNew(void) {
     dm_project.clear();
     dm_project.notifyChange(0);
+    dm_perspectiveaction->setChecked(false);
 
     updateTitle();
 }
@@ -244,7 +248,9 @@ void MainWindow::onPrint(void) {
     progdlg.setWindowModality(Qt::ApplicationModal);
     progdlg.setMinimumDuration(0);
 
-    dm_project.exportToPrinter(&dm_printer);
+    DialogExportProgress progress(&progdlg);
+
+    dm_project.exportToPrinter(&dm_printer, &progress);
 }
 
 void MainWindow::onPrintPDF(void) {
@@ -260,11 +266,11 @@ void MainWindow::onPrintPDF(void) {
     progdlg.setWindowModality(Qt::ApplicationModal);
     progdlg.setMinimumDuration(0);
 
-    QPrinter printer(QPrinter::HighResolution);
-    printer.setOutputFileName(fileName);
-    printer.setPageSize(QPrinter::Letter);
+    DialogExportProgress progress(&progdlg);
 
-    dm_project.exportToPrinter(&printer, &progdlg);
+    if (!dm_project.exportToPdf(fileName, &progress) && !progdlg.wasCanceled())
+        QMessageBox::warning(this, "Export to PDF File",
+                             "Could not write " + fileName);
 
     dm_pdfoutfilename = fileName;
 }
@@ -288,11 +294,44 @@ void MainWindow::onPrintFiles(void) {
     progdlg.setWindowModality(Qt::ApplicationModal);
     progdlg.setMinimumDuration(0);
 
-    dm_project.exportToFiles(fileName, &progdlg);
+    DialogExportProgress progress(&progdlg);
+
+    dm_project.exportToFiles(fileName, &progress);
 
     dm_imageoutname = fileName;
 }
 
+void MainWindow::onPerspectiveClip(bool on) {
+    dm_project.setClipMapping(on ? ClipAlg::PERSPECTIVE_MAPPING
+                                 : ClipAlg::QUAD_MAPPING);
+    dm_project.notifyChange(0);
+}
+
+void MainWindow::onExportDpi(void) {
+    bool ok;
+    int dpi = QInputDialog::getInt(
+        this, "Export Resolution",
+        "Largest resolution for printing and PDFs, in DPI\n"
+        "(0 for the full printer resolution):",
+        dm_project.exportDpi(), 0, 2400, 50, &ok);
+
+    if (ok)
+        dm_project.setExportDpi(dpi);
+}
+
+void MainWindow::onSaveStats(void) {
+    QString fileName = QFileDialog::getSaveFileName(
+        this, "Save Statistics", "pocketscan-stats.json",
+        "JSON Files (*.json);;All Files (*)");
+
+    if (fileName.isEmpty())
+        return;
+
+    if (!Stats::dump(fileName))
+        QMessageBox::warning(this, "Save Statistics",
+                             "Could not write " + fileName);
+}
+
 void MainWindow::onShowAbout(void) {
     AboutDialog about(this, "PocketScan");
 
@@ -397,6 +436,15 @@ void MainWindow::initGui(void) {
     connect(menu->addAction("&Print..."), SIGNAL(triggered()), this,
             SLOT(onPrint()));
     menu->addSeparator();
+    dm_perspectiveaction = menu->addAction("Perspective Page &Correction");
+    dm_perspectiveaction->setCheckable(true);
+    connect(dm_perspectiveaction, SIGNAL(triggered(bool)), this,
+            SLOT(onPerspectiveClip(bool)));
+    connect(menu->addAction("Export &Resolution..."), SIGNAL(triggered()),
+            this, SLOT(onExportDpi()));
+    menu->addSeparator();
+    connect(menu->addAction("Save S&tatistics..."), SIGNAL(triggered()), this,
+            SLOT(onSaveStats()));
     connect(menu->addAction("&About"), SIGNAL(triggered()), this,
             SLOT(onShowAbout()));
     menu->addSeparator();
@@ -451,6 +499,8 @@ void MainWindow::openFile(const QString &fileName) {
     }
 
     dm_project.notifyChange(0);
+    dm_perspectiveaction->setChecked(dm_project.clipMapping() ==
+                                     ClipAlg::PERSPECTIVE_MAPPING);
     updateTitle();
 }
 
@@ -62,6 +62,10 @@ class MainWindow : public QMainWindow {
     void onPrintPDF(void);
     void onPrintFiles(void);
 
+    void onPerspectiveClip(bool on);
+    void onExportDpi(void);
+
+    void onSaveStats(void);
     void onShowAbout(void);
 
     void onPrintPage(QPrinter *printer);
@@ -106,6 +110,8 @@ class MainWindow : public QMainWindow {
     // ImageAddButton *dm_addbut;
     TabBar *dm_tabbar;
 
+    QAction *dm_perspectiveaction;
+
     Project dm_project;
 
     QPrinter dm_printer;
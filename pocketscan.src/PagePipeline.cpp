@@ -0,0 +1,201 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <PagePipeline.h>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <ExportProgress.h>
+#include <Stats.h>
+#include <Trace.h>
+
+// how often the calling thread looks at the progress dialog while waiting
+static const unsigned long POLL_MS = 100;
+
+class PagePipeline::State {
+  public:
+    const PageFunc *work;
+
+    QMutex lock;
+    QWaitCondition cond;
+    std::map<int, QImage> ready; // done, but not yet handed back
+    int finished;                // the number of Runners that have run
+
+    QAtomicInt stopped;
+};
+
+class PagePipeline::Runner : public QRunnable {
+  public:
+    Runner(State *state, int pageno) : dm_state(state), dm_pageno(pageno) {}
+
+    virtual void run(void) {
+        QImage img;
+
+        if (!dm_state->stopped.load())
+            img = (*dm_state->work)(dm_pageno);
+
+        QMutexLocker L(&dm_state->lock);
+
+        dm_state->ready[dm_pageno] = img;
+        ++dm_state->finished;
+        dm_state->cond.wakeAll();
+    }
+
+  private:
+    State *dm_state;
+    int dm_pageno;
+};
+
+//
+// PagePipeline::Budget
+//
+
+PagePipeline::Budget::Budget(qint64 maxbytes)
+    : dm_maxbytes(maxbytes > 0 ? maxbytes : defaultMaxBytes()),
+      dm_usedbytes(0) {}
+
+qint64 PagePipeline::Budget::usedBytes(void) {
+    QMutexLocker L(&dm_lock);
+
+    return dm_usedbytes;
+}
+
+bool PagePipeline::Budget::tryAcquire(qint64 bytes, bool force) {
+    QMutexLocker L(&dm_lock);
+
+    if (!force && dm_usedbytes + bytes > dm_maxbytes)
+        return false;
+
+    dm_usedbytes += bytes;
+
+    return true;
+}
+
+void PagePipeline::Budget::release(qint64 bytes) {
+    QMutexLocker L(&dm_lock);
+
+    dm_usedbytes -= bytes;
+}
+
+//
+// PagePipeline
+//
+
+PagePipeline::PagePipeline(QThreadPool *pool, Budget *budget)
+    : dm_pool(pool ? pool : QThreadPool::globalInstance()),
+      dm_budget(budget ? budget : &dm_ownbudget) {
+    dm_maxpages = std::max(1, dm_pool->maxThreadCount()) * PAGES_PER_THREAD;
+}
+
+qint64 PagePipeline::defaultMaxBytes(void) {
+    const char *mb = getenv("POCKETSCAN_PIPELINE_MB");
+
+    if (mb && atoll(mb) > 0)
+        return static_cast<qint64>(atoll(mb)) * 1024 * 1024;
+
+    return static_cast<qint64>(DEFAULT_MAX_MB) * 1024 * 1024;
+}
+
+bool PagePipeline::run(int numpages, const PageFunc &work,
+                       const CostFunc &cost, const DoneFunc &done,
+                       ExportProgress *progress) {
+    State state;
+    std::vector<qint64> costs(numpages, -1);
+    int maxpages = std::max(1, dm_maxpages);
+    int nextpage = 0, donepages = 0, inflight = 0;
+    bool ok = true;
+
+    state.work = &work;
+    state.finished = 0;
+
+    while (donepages < numpages) {
+        // start as many pages as the ceilings allow (but always at least
+        // one), in order so that the next one to hand back is always
+        // started first
+        while (nextpage < numpages && inflight < maxpages) {
+            if (costs[nextpage] < 0)
+                costs[nextpage] = cost ? cost(nextpage) : 0;
+            if (!dm_budget->tryAcquire(costs[nextpage], inflight == 0))
+                break;
+
+            ++inflight;
+            dm_pool->start(new Runner(&state, nextpage));
+            ++nextpage;
+        }
+
+        QImage img;
+        bool haveimg = false;
+
+        {
+            TRACE_SCOPE("pipeline wait");
+            QElapsedTimer timer;
+            QMutexLocker L(&state.lock);
+            std::map<int, QImage>::iterator ii = state.ready.find(donepages);
+
+            timer.start();
+            if (ii == state.ready.end()) {
+                state.cond.wait(&state.lock, POLL_MS);
+                ii = state.ready.find(donepages);
+            }
+            if (ii != state.ready.end()) {
+                img = ii->second;
+                state.ready.erase(ii);
+                haveimg = true;
+            }
+            Stats::record("pipeline.wait_ms", timer.nsecsElapsed() / 1.0e6);
+        }
+
+        if (haveimg) {
+            dm_budget->release(costs[donepages]);
+            --inflight;
+
+            bool keepgoing = !done || done(donepages, img);
+
+            ++donepages;
+            Stats::add("pipeline.pages");
+
+            if (!keepgoing) {
+                ok = false;
+                break;
+            }
+        }
+
+        if (progress) {
+            progress->setPagesDone(donepages);
+            if (progress->isCanceled()) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    // the pool may be shared, so rather than clearing it, have the pages
+    // still queued do nothing, and wait for just this run's pages
+    if (!ok)
+        state.stopped.store(1);
+
+    {
+        QMutexLocker L(&state.lock);
+
+        while (state.finished < nextpage)
+            state.cond.wait(&state.lock);
+    }
+
+    for (int pageno = donepages; pageno < nextpage; ++pageno)
+        dm_budget->release(costs[pageno]);
+
+    return ok;
+}
@@ -0,0 +1,124 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_PAGEPIPELINE_H__
+#define __INCLUDED_POCKETSCAN_PAGEPIPELINE_H__
+
+#include <functional>
+
+#include <QImage>
+#include <QMutex>
+#include <QThreadPool>
+
+class ExportProgress;
+
+/**
+ * Works on several pages of a book at once, on a thread pool, while
+ * handing the results back to the calling thread strictly in page order.
+ *
+ * The number of pages in flight (being worked on, or done but waiting
+ * for an earlier page) is bounded, both in count and in (estimated) bytes,
+ * so that a book of big scans doesn't pile up in memory.
+ *
+ * The threads and the byte budget may be shared between pipelines (even
+ * running at the same time, for different books), so that several books
+ * can be worked on without oversubscribing the machine. By default, the
+ * pages run on the global pool, the same one ImageAlg fans out onto, so
+ * that once the pages fill it, each ImageAlg just runs on its page's
+ * thread rather than adding threads of its own.
+ *
+ * @author Aleksander Demko
+ */
+class PagePipeline {
+  public:
+    /// does the work for one page, on one of the pipeline's threads
+    typedef std::function<QImage(int pageno)> PageFunc;
+    /// estimates the bytes a page holds while its in flight
+    typedef std::function<qint64(int pageno)> CostFunc;
+    /// takes a finished page, on the calling thread. returns false to stop
+    typedef std::function<bool(int pageno, const QImage &img)> DoneFunc;
+
+    /**
+     * The bytes that may be in flight, shared by the pipelines that use it.
+     * Thread safe.
+     *
+     * @author Aleksander Demko
+     */
+    class Budget {
+      public:
+        /// maxbytes of 0 means defaultMaxBytes()
+        Budget(qint64 maxbytes = 0);
+
+        qint64 maxBytes(void) const { return dm_maxbytes; }
+        qint64 usedBytes(void);
+
+        /**
+         * Takes the given bytes from the budget, if they fit (or always if
+         * force is true). Returns false if they don't.
+         *
+         * @author Aleksander Demko
+         */
+        bool tryAcquire(qint64 bytes, bool force);
+        /// gives back bytes taken by tryAcquire
+        void release(qint64 bytes);
+
+      private:
+        QMutex dm_lock;
+        qint64 dm_maxbytes, dm_usedbytes;
+    };
+
+    /**
+     * Constructor. The pipeline uses the given pool and budget, or the
+     * global pool and its own budget (of defaultMaxBytes()) if they are
+     * null.
+     *
+     * @author Aleksander Demko
+     */
+    PagePipeline(QThreadPool *pool = 0, Budget *budget = 0);
+
+    static const int DEFAULT_MAX_MB = 1024;
+
+    /// DEFAULT_MAX_MB, or the POCKETSCAN_PIPELINE_MB environment variable
+    static qint64 defaultMaxBytes(void);
+
+    /// how many pages may be in flight per thread
+    static const int PAGES_PER_THREAD = 2;
+
+    /// sets how many pages may be in flight, instead of PAGES_PER_THREAD
+    void setMaxPages(int maxpages) { dm_maxpages = maxpages; }
+
+    /**
+     * Runs work on the pages 0 to numpages-1, calling done (if any) with
+     * each result in page order. cost may be empty, in which case only
+     * the number of pages in flight is bounded. A single page is always let
+     * through, even if its over the byte ceiling (so with a shared
+     * budget, each running pipeline may go over it by a page).
+     *
+     * If progress is given, its kept up to date with the number of pages
+     * done, and canceling it stops the run.
+     *
+     * Returns true if all the pages were done, false if the run was
+     * canceled or stopped by done. Either way, nothing is running by the
+     * time this returns.
+     *
+     * @author Aleksander Demko
+     */
+    bool run(int numpages, const PageFunc &work, const CostFunc &cost,
+             const DoneFunc &done, ExportProgress *progress = 0);
+
+  private:
+    class Runner;
+    class State;
+
+    Budget dm_ownbudget;
+
+    QThreadPool *dm_pool;
+    Budget *dm_budget;
+    int dm_maxpages;
+};
+
+#endif
@@ -0,0 +1,298 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <PdfWriter.h>
+
+#include <algorithm>
+
+#include <QBuffer>
+#include <QImageWriter>
+
+// pixels darker or lighter than these count as black or white
+static const int BILEVEL_DARK = 64;
+static const int BILEVEL_LIGHT = 192;
+// pixels whose channels differ by more than this count as coloured
+static const int BILEVEL_CHROMA = 48;
+// the most pixels that may be neither, for an image to count as bilevel
+static const double BILEVEL_MAX_FRACTION = 0.03;
+
+static int bigEndian16(const uchar *p) { return (p[0] << 8) | p[1]; }
+
+bool PdfWriter::jpegImage(const QByteArray &jpeg, Image &out) {
+    const uchar *data = reinterpret_cast<const uchar *>(jpeg.constData());
+    int size = jpeg.size(), pos = 2;
+
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+
+    // walk the markers up to the start of frame, for the size and depth
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF)
+            return false;
+
+        int marker = data[pos + 1];
+
+        if (marker == 0xFF) { // fill byte
+            ++pos;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2; // no length
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA)
+            return false; // end of image or start of scan, no frame?
+
+        int len = bigEndian16(data + pos + 2);
+
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            if (pos + 10 > size)
+                return false;
+
+            int precision = data[pos + 4];
+            int components = data[pos + 9];
+
+            // only baseline, extended and progressive huffman frames (the
+            // ones DCTDecode takes). lossless, hierarchical and arithmetic
+            // coded ones aren't in every reader, and CMYK JPEGs need
+            // inverting depending on who made them
+            if (marker > 0xC2 || precision != 8 ||
+                (components != 1 && components != 3))
+                return false;
+
+            out.data = jpeg;
+            out.size = QSize(bigEndian16(data + pos + 7),
+                             bigEndian16(data + pos + 5));
+            out.components = components;
+            out.bits = 8;
+            out.filter = Image::DCT_FILTER;
+
+            return !out.size.isEmpty();
+        }
+
+        pos += 2 + len;
+    }
+
+    return false;
+}
+
+void PdfWriter::jpegImage(const QImage &img, int quality, Image &out) {
+    QByteArray jpeg;
+    QBuffer buf(&jpeg);
+    QImageWriter writer(&buf, "jpeg");
+
+    buf.open(QIODevice::WriteOnly);
+    writer.setQuality(quality);
+
+    if (img.allGray())
+        writer.write(img.convertToFormat(QImage::Format_Grayscale8));
+    else
+        writer.write(img);
+    buf.close();
+
+    // and back again, so the size and components match what was written
+    if (!jpegImage(jpeg, out))
+        out = Image();
+}
+
+// the given image in RGB32 or ARGB32, for fast scan line access
+static QImage kernelImage(const QImage &img) {
+    if (img.format() == QImage::Format_RGB32 ||
+        img.format() == QImage::Format_ARGB32)
+        return img;
+
+    return img.convertToFormat(QImage::Format_RGB32);
+}
+
+bool PdfWriter::isBilevel(const QImage &_img) {
+    QImage img(kernelImage(_img));
+    int w = img.width(), h = img.height();
+    qint64 maxmid =
+        static_cast<qint64>(BILEVEL_MAX_FRACTION * static_cast<double>(w) * h);
+    qint64 mid = 0;
+
+    for (int y = 0; y < h; ++y) {
+        const QRgb *in = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+
+        for (int x = 0; x < w; ++x) {
+            int r = qRed(in[x]), g = qGreen(in[x]), b = qBlue(in[x]);
+            int lo = std::min(r, std::min(g, b));
+            int hi = std::max(r, std::max(g, b));
+            int gray = qGray(in[x]);
+
+            if (hi - lo > BILEVEL_CHROMA ||
+                (gray > BILEVEL_DARK && gray < BILEVEL_LIGHT))
+                ++mid;
+        }
+
+        // early out for the (many) photo pages
+        if (mid > maxmid)
+            return false;
+    }
+
+    return true;
+}
+
+void PdfWriter::bilevelImage(const QImage &_img, Image &out) {
+    QImage img(kernelImage(_img));
+    int w = img.width(), h = img.height();
+    int rowbytes = (w + 7) / 8;
+    QByteArray bits(rowbytes * h, 0);
+
+    // 1 bits are white, in DeviceGray
+    for (int y = 0; y < h; ++y) {
+        const QRgb *in = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+        uchar *row = reinterpret_cast<uchar *>(bits.data()) + y * rowbytes;
+
+        for (int x = 0; x < w; ++x)
+            if (qGray(in[x]) >= 128)
+                row[x >> 3] |= 0x80 >> (x & 7);
+    }
+
+    // qCompress gives a zlib stream, after its own 4 byte length
+    out.data = qCompress(bits).mid(4);
+    out.size = img.size();
+    out.components = 1;
+    out.bits = 1;
+    out.filter = Image::FLATE_FILTER;
+}
+
+//
+//
+// PdfWriter
+//
+//
+
+PdfWriter::PdfWriter(const QSize &pagesize)
+    : dm_pagesize(pagesize), dm_ok(false) {}
+
+PdfWriter::~PdfWriter() {
+    if (dm_file.isOpen())
+        abort();
+}
+
+bool PdfWriter::open(const QString &filename) {
+    dm_file.setFileName(filename);
+    dm_ok = dm_file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+
+    // object 1 is the catalog and 2 the page tree, both written by close()
+    dm_offsets.assign(3, 0);
+    dm_pages.clear();
+
+    // the binary comment marks the file as binary to any transfer programs
+    return write("%PDF-1.4\n%\xE2\xE3\xCF\xD3\n");
+}
+
+bool PdfWriter::addPage(const Image &img) {
+    if (img.isNull() || img.size.isEmpty())
+        return false;
+
+    // fit the image on the page, centered
+    double scale =
+        std::min(static_cast<double>(dm_pagesize.width()) / img.size.width(),
+                 static_cast<double>(dm_pagesize.height()) / img.size.height());
+    double w = img.size.width() * scale, h = img.size.height() * scale;
+    double x = (dm_pagesize.width() - w) / 2;
+    double y = (dm_pagesize.height() - h) / 2;
+
+    int imageobj = beginObject();
+
+    write("<< /Type /XObject /Subtype /Image /Width " +
+          QByteArray::number(img.size.width()) + " /Height " +
+          QByteArray::number(img.size.height()) + " /ColorSpace " +
+          (img.components == 1 ? "/DeviceGray" : "/DeviceRGB") +
+          " /BitsPerComponent " + QByteArray::number(img.bits) + " /Filter " +
+          (img.filter == Image::DCT_FILTER ? "/DCTDecode" : "/FlateDecode") +
+          " /Length " + QByteArray::number(img.data.size()) + " >>\nstream\n");
+    write(img.data);
+    write("\nendstream\nendobj\n");
+
+    QByteArray content("q " + QByteArray::number(w, 'f', 2) + " 0 0 " +
+                       QByteArray::number(h, 'f', 2) + " " +
+                       QByteArray::number(x, 'f', 2) + " " +
+                       QByteArray::number(y, 'f', 2) + " cm /Im0 Do Q\n");
+    int contentobj = beginObject();
+
+    write("<< /Length " + QByteArray::number(content.size()) +
+          " >>\nstream\n" + content + "endstream\nendobj\n");
+
+    int pageobj = beginObject();
+
+    write("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 " +
+          QByteArray::number(dm_pagesize.width()) + " " +
+          QByteArray::number(dm_pagesize.height()) +
+          "] /Resources << /XObject << /Im0 " + QByteArray::number(imageobj) +
+          " 0 R >> >> /Contents " + QByteArray::number(contentobj) +
+          " 0 R >>\nendobj\n");
+
+    dm_pages.push_back(pageobj);
+
+    return dm_ok;
+}
+
+bool PdfWriter::close(void) {
+    QByteArray kids;
+
+    for (size_t i = 0; i < dm_pages.size(); ++i)
+        kids += QByteArray::number(dm_pages[i]) + " 0 R ";
+
+    beginObject(2);
+    write("<< /Type /Pages /Kids [ " + kids +
+          "] /Count " + QByteArray::number(static_cast<int>(dm_pages.size())) +
+          " >>\nendobj\n");
+
+    beginObject(1);
+    write("<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+
+    qint64 xref = dm_file.pos();
+    QByteArray out("xref\n0 " +
+                   QByteArray::number(static_cast<int>(dm_offsets.size())) +
+                   "\n0000000000 65535 f \n");
+
+    // each entry is exactly 20 bytes
+    for (size_t i = 1; i < dm_offsets.size(); ++i)
+        out += QByteArray::number(dm_offsets[i]).rightJustified(10, '0') +
+               " 00000 n \n";
+
+    out += "trailer\n<< /Size " +
+           QByteArray::number(static_cast<int>(dm_offsets.size())) +
+           " /Root 1 0 R >>\nstartxref\n" + QByteArray::number(xref) +
+           "\n%%EOF\n";
+    write(out);
+
+    dm_file.close();
+
+    return dm_ok && dm_file.error() == QFileDevice::NoError;
+}
+
+void PdfWriter::abort(void) {
+    dm_file.close();
+    dm_file.remove();
+    dm_ok = false;
+}
+
+int PdfWriter::beginObject(void) {
+    int obj = static_cast<int>(dm_offsets.size());
+
+    dm_offsets.push_back(0);
+    beginObject(obj);
+
+    return obj;
+}
+
+void PdfWriter::beginObject(int obj) {
+    dm_offsets[obj] = dm_file.pos();
+    write(QByteArray::number(obj) + " 0 obj\n");
+}
+
+bool PdfWriter::write(const QByteArray &data) {
+    if (dm_ok && dm_file.write(data) != data.size())
+        dm_ok = false;
+
+    return dm_ok;
+}
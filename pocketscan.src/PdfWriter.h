@@ -0,0 +1,119 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_PDFWRITER_H__
+#define __INCLUDED_POCKETSCAN_PDFWRITER_H__
+
+#include <vector>
+
+#include <QByteArray>
+#include <QFile>
+#include <QImage>
+#include <QSize>
+
+/**
+ * Writes a PDF of one image per page, without going through QPrinter.
+ *
+ * The images are given already encoded (see the Image makers), so JPEG
+ * files can be embedded as is and black and white pages as 1-bit bitmaps.
+ * Each page is written out as it's added, so only the (small) object
+ * offsets are kept in memory.
+ *
+ * The image makers are thread safe, the rest is not.
+ *
+ * @author Aleksander Demko
+ */
+class PdfWriter {
+  public:
+    /// an encoded image, ready to be put on a page
+    class Image {
+      public:
+        enum Filter {
+            DCT_FILTER,  // JPEG
+            FLATE_FILTER // zlib
+        };
+
+        QByteArray data;
+        QSize size;
+        int components; // 1 (gray) or 3 (rgb)
+        int bits;       // per component
+        Filter filter;
+
+        Image(void) : components(0), bits(0), filter(DCT_FILTER) {}
+
+        bool isNull(void) const { return data.isEmpty(); }
+    };
+
+    /// US letter, in points
+    static const int LETTER_WIDTH = 612;
+    static const int LETTER_HEIGHT = 792;
+
+    static const int DEFAULT_JPEG_QUALITY = 85;
+
+    /**
+     * Makes an image out of the bytes of a JPEG file, to be embedded as is.
+     * Returns false if the data isn't a JPEG that PDF readers can show
+     * directly (only 8 bit gray or YCbCr/RGB baseline, extended or
+     * progressive ones are taken).
+     *
+     * @author Aleksander Demko
+     */
+    static bool jpegImage(const QByteArray &jpeg, Image &out);
+
+    /// makes an image by JPEG encoding img (as gray, if its all gray)
+    static void jpegImage(const QImage &img, int quality, Image &out);
+
+    /**
+     * Is the image (nearly) only black and white? That is, are few enough
+     * of its pixels grey or coloured that it can be made 1-bit.
+     *
+     * @author Aleksander Demko
+     */
+    static bool isBilevel(const QImage &img);
+
+    /// makes a 1-bit, Flate compressed image by thresholding img
+    static void bilevelImage(const QImage &img, Image &out);
+
+    /// constructor. pagesize is in points
+    PdfWriter(const QSize &pagesize = QSize(LETTER_WIDTH, LETTER_HEIGHT));
+    /// abort()s if the file wasn't close()d
+    ~PdfWriter();
+
+    /// starts a new file. returns false on errors
+    bool open(const QString &filename);
+
+    /**
+     * Adds a page, with the image scaled to fit (centered) on it.
+     * Returns false on errors.
+     *
+     * @author Aleksander Demko
+     */
+    bool addPage(const Image &img);
+
+    /// finishes the file. returns false on errors
+    bool close(void);
+
+    /// gives up on the file, deleting it
+    void abort(void);
+
+  private:
+    /// starts a new object, returning its number
+    int beginObject(void);
+    void beginObject(int obj);
+    bool write(const QByteArray &data);
+
+  private:
+    QSize dm_pagesize;
+
+    QFile dm_file;
+    bool dm_ok;
+
+    std::vector<qint64> dm_offsets; // indexed by object number, 0 is unused
+    std::vector<int> dm_pages;      // object numbers
+};
+
+#endif
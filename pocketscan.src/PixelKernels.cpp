@@ -0,0 +1,628 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <PixelKernels.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#define POCKETSCAN_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// gcc and clang need to be told which functions may use which instructions,
+// msvc lets you use any intrinsic anywhere
+#if defined(__GNUC__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+static const QRgb WHITE_PIXEL = 0xFFFFFFFF;
+static const QRgb BLACK_PIXEL = 0xFF000000;
+
+//
+// scalar kernels
+//
+
+static void levelRowScalar(const QRgb *in, QRgb *out, int w,
+                           const PixelKernels::LevelTable &table) {
+    for (int x = 0; x < w; ++x) {
+        QRgb rgb = in[x];
+
+        out[x] = BLACK_PIXEL | table.red[qRed(rgb)] |
+                 table.green[qGreen(rgb)] | table.blue[qBlue(rgb)];
+    }
+}
+
+static int avgThresholdRowScalar(const QRgb *in, QRgb *out, int w,
+                                 int thres) {
+    int count = 0;
+
+    for (int x = 0; x < w; ++x) {
+        QRgb rgb = in[x];
+        bool b = (qRed(rgb) + qGreen(rgb) + qBlue(rgb)) / 3 > thres;
+
+        out[x] = b ? WHITE_PIXEL : BLACK_PIXEL;
+        if (b)
+            ++count;
+    }
+
+    return count;
+}
+
+static void valueRowScalar(const QRgb *in, uchar *out, int w) {
+    for (int x = 0; x < w; ++x)
+        out[x] = std::max(std::max(qRed(in[x]), qGreen(in[x])), qBlue(in[x]));
+}
+
+static void lumaRowScalar(const QRgb *in, uchar *out, int w) {
+    for (int x = 0; x < w; ++x)
+        out[x] = qGray(in[x]);
+}
+
+// (a*(256-w) + b*w) / 256, rounded, for each channel, with w 0..256
+// the red and blue, and the alpha and green, channels are done together
+static inline QRgb lerpPixel(QRgb a, QRgb b, quint32 w) {
+    quint32 rb = ((a & 0x00FF00FF) * (256 - w) + (b & 0x00FF00FF) * w +
+                  0x00800080) >>
+                 8;
+    quint32 ag = ((a >> 8) & 0x00FF00FF) * (256 - w) +
+                 ((b >> 8) & 0x00FF00FF) * w + 0x00800080;
+
+    return (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+}
+
+// the fraction of a fixed point position, rounded to 0..256
+static inline quint32 fixedWeight(qint64 pos) {
+    quint32 frac9 =
+        static_cast<quint32>(pos >> (PixelKernels::FIXED_SHIFT - 9)) & 0x1FF;
+
+    return (frac9 + 1) >> 1;
+}
+
+// the top left pixel of the 2x2 neighbourhood of a fixed point position
+static inline const QRgb *
+spanPixel(const PixelKernels::BilinearSpan &span, qint64 x, qint64 y) {
+    return span.origin + (x >> PixelKernels::FIXED_SHIFT) * span.pixstepx +
+           (y >> PixelKernels::FIXED_SHIFT) * span.pixstepy;
+}
+
+static void bilinearRowScalar(const PixelKernels::BilinearSpan &span,
+                              QRgb *out, int n) {
+    qint64 x = span.x, y = span.y;
+
+    for (int i = 0; i < n; ++i) {
+        const QRgb *p = spanPixel(span, x, y);
+        quint32 wx = fixedWeight(x);
+
+        QRgb top = lerpPixel(p[0], p[span.pixstepx], wx);
+        QRgb bottom = lerpPixel(p[span.pixstepy],
+                                p[span.pixstepx + span.pixstepy], wx);
+
+        out[i] = BLACK_PIXEL | lerpPixel(top, bottom, fixedWeight(y));
+
+        x += span.stepx;
+        y += span.stepy;
+    }
+}
+
+#ifdef POCKETSCAN_X86
+
+//
+// SSE4.1 kernels
+//
+
+// (r + g + b) / 3 > thres  is the same as  r + g + b > 3 * thres + 2
+TARGET_SSE41 static int avgThresholdRowSSE41(const QRgb *in, QRgb *out, int w,
+                                             int thres) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i limit = _mm_set1_epi32(3 * thres + 2);
+    const __m128i black = _mm_set1_epi32(static_cast<int>(BLACK_PIXEL));
+    const __m128i rgbmask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i count = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 4 <= w; x += 4) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + x));
+        __m128i sum = _mm_add_epi32(
+            _mm_and_si128(p, mask),
+            _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(p, 8), mask),
+                          _mm_and_si128(_mm_srli_epi32(p, 16), mask)));
+        __m128i white = _mm_cmpgt_epi32(sum, limit);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                         _mm_or_si128(black, _mm_and_si128(white, rgbmask)));
+        // white is -1 in the lanes that are white
+        count = _mm_sub_epi32(count, white);
+    }
+
+    int lanes[4];
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), count);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           avgThresholdRowScalar(in + x, out + x, w - x, thres);
+}
+
+TARGET_SSE41 static inline __m128i value4SSE41(const QRgb *in) {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    // the low byte of each lane is now max(b, g, r)
+    __m128i m = _mm_max_epu8(_mm_max_epu8(p, _mm_srli_epi32(p, 8)),
+                             _mm_srli_epi32(p, 16));
+
+    return _mm_and_si128(m, _mm_set1_epi32(0xFF));
+}
+
+TARGET_SSE41 static inline __m128i luma4SSE41(const QRgb *in) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+    __m128i b = _mm_and_si128(p, mask);
+
+    // qGray(): (r*11 + g*16 + b*5) / 32
+    __m128i sum = _mm_add_epi32(_mm_mullo_epi32(r, _mm_set1_epi32(11)),
+                                _mm_slli_epi32(g, 4));
+    sum = _mm_add_epi32(sum, _mm_mullo_epi32(b, _mm_set1_epi32(5)));
+
+    return _mm_srli_epi32(sum, 5);
+}
+
+// packs 16 lanes of 0..255 ints into 16 bytes
+TARGET_SSE41 static inline void store16SSE41(uchar *out, __m128i v0,
+                                             __m128i v1, __m128i v2,
+                                             __m128i v3) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                     _mm_packus_epi16(_mm_packus_epi32(v0, v1),
+                                      _mm_packus_epi32(v2, v3)));
+}
+
+// lerpPixel() on 16-bit channels
+TARGET_SSE41 static inline __m128i lerp16SSE41(__m128i a, __m128i b,
+                                               __m128i w) {
+    __m128i inv = _mm_sub_epi16(_mm_set1_epi16(256), w);
+    __m128i sum =
+        _mm_add_epi16(_mm_mullo_epi16(a, inv), _mm_mullo_epi16(b, w));
+
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+// the pixels are fetched one by one, but blended 4 at a time
+TARGET_SSE41 static void
+bilinearRowSSE41(const PixelKernels::BilinearSpan &span, QRgb *out, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i black = _mm_set1_epi32(static_cast<int>(BLACK_PIXEL));
+    QRgb tl[4], tr[4], bl[4], br[4];
+    short wx[4], wy[4];
+    qint64 x = span.x, y = span.y;
+    int i = 0, k;
+
+    for (; i + 4 <= n; i += 4) {
+        for (k = 0; k < 4; ++k) {
+            const QRgb *p = spanPixel(span, x, y);
+
+            tl[k] = p[0];
+            tr[k] = p[span.pixstepx];
+            bl[k] = p[span.pixstepy];
+            br[k] = p[span.pixstepx + span.pixstepy];
+            wx[k] = fixedWeight(x);
+            wy[k] = fixedWeight(y);
+
+            x += span.stepx;
+            y += span.stepy;
+        }
+
+        __m128i vtl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tl));
+        __m128i vtr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tr));
+        __m128i vbl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bl));
+        __m128i vbr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(br));
+        // each weight repeated for the 4 channels of its pixel
+        __m128i wxlo = _mm_set_epi16(wx[1], wx[1], wx[1], wx[1], wx[0], wx[0],
+                                     wx[0], wx[0]);
+        __m128i wxhi = _mm_set_epi16(wx[3], wx[3], wx[3], wx[3], wx[2], wx[2],
+                                     wx[2], wx[2]);
+        __m128i wylo = _mm_set_epi16(wy[1], wy[1], wy[1], wy[1], wy[0], wy[0],
+                                     wy[0], wy[0]);
+        __m128i wyhi = _mm_set_epi16(wy[3], wy[3], wy[3], wy[3], wy[2], wy[2],
+                                     wy[2], wy[2]);
+
+        __m128i lo = lerp16SSE41(
+            lerp16SSE41(_mm_unpacklo_epi8(vtl, zero),
+                        _mm_unpacklo_epi8(vtr, zero), wxlo),
+            lerp16SSE41(_mm_unpacklo_epi8(vbl, zero),
+                        _mm_unpacklo_epi8(vbr, zero), wxlo),
+            wylo);
+        __m128i hi = lerp16SSE41(
+            lerp16SSE41(_mm_unpackhi_epi8(vtl, zero),
+                        _mm_unpackhi_epi8(vtr, zero), wxhi),
+            lerp16SSE41(_mm_unpackhi_epi8(vbl, zero),
+                        _mm_unpackhi_epi8(vbr, zero), wxhi),
+            wyhi);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_or_si128(black, _mm_packus_epi16(lo, hi)));
+    }
+
+    PixelKernels::BilinearSpan rest(span);
+
+    rest.x = x;
+    rest.y = y;
+    bilinearRowScalar(rest, out + i, n - i);
+}
+
+TARGET_SSE41 static void valueRowSSE41(const QRgb *in, uchar *out, int w) {
+    int x = 0;
+
+    for (; x + 16 <= w; x += 16)
+        store16SSE41(out + x, value4SSE41(in + x), value4SSE41(in + x + 4),
+                     value4SSE41(in + x + 8), value4SSE41(in + x + 12));
+
+    valueRowScalar(in + x, out + x, w - x);
+}
+
+TARGET_SSE41 static void lumaRowSSE41(const QRgb *in, uchar *out, int w) {
+    int x = 0;
+
+    for (; x + 16 <= w; x += 16)
+        store16SSE41(out + x, luma4SSE41(in + x), luma4SSE41(in + x + 4),
+                     luma4SSE41(in + x + 8), luma4SSE41(in + x + 12));
+
+    lumaRowScalar(in + x, out + x, w - x);
+}
+
+//
+// AVX2 kernels
+//
+
+TARGET_AVX2 static void levelRowAVX2(const QRgb *in, QRgb *out, int w,
+                                     const PixelKernels::LevelTable &table) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m256i black = _mm256_set1_epi32(static_cast<int>(BLACK_PIXEL));
+    const int *red = reinterpret_cast<const int *>(table.red);
+    const int *green = reinterpret_cast<const int *>(table.green);
+    const int *blue = reinterpret_cast<const int *>(table.blue);
+    int x = 0;
+
+    for (; x + 8 <= w; x += 8) {
+        __m256i p =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + x));
+        __m256i r = _mm256_i32gather_epi32(
+            red, _mm256_and_si256(_mm256_srli_epi32(p, 16), mask), 4);
+        __m256i g = _mm256_i32gather_epi32(
+            green, _mm256_and_si256(_mm256_srli_epi32(p, 8), mask), 4);
+        __m256i b = _mm256_i32gather_epi32(blue, _mm256_and_si256(p, mask), 4);
+
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(out + x),
+            _mm256_or_si256(_mm256_or_si256(black, r), _mm256_or_si256(g, b)));
+    }
+
+    levelRowScalar(in + x, out + x, w - x, table);
+}
+
+TARGET_AVX2 static int avgThresholdRowAVX2(const QRgb *in, QRgb *out, int w,
+                                           int thres) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    const __m256i limit = _mm256_set1_epi32(3 * thres + 2);
+    const __m256i black = _mm256_set1_epi32(static_cast<int>(BLACK_PIXEL));
+    const __m256i rgbmask = _mm256_set1_epi32(0x00FFFFFF);
+    __m256i count = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + 8 <= w; x += 8) {
+        __m256i p =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + x));
+        __m256i sum = _mm256_add_epi32(
+            _mm256_and_si256(p, mask),
+            _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask),
+                             _mm256_and_si256(_mm256_srli_epi32(p, 16), mask)));
+        __m256i white = _mm256_cmpgt_epi32(sum, limit);
+
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(out + x),
+            _mm256_or_si256(black, _mm256_and_si256(white, rgbmask)));
+        count = _mm256_sub_epi32(count, white);
+    }
+
+    int lanes[8];
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), count);
+
+    int total = 0;
+    for (int i = 0; i < 8; ++i)
+        total += lanes[i];
+
+    return total + avgThresholdRowScalar(in + x, out + x, w - x, thres);
+}
+
+TARGET_AVX2 static inline __m256i value8AVX2(const QRgb *in) {
+    __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+    __m256i m = _mm256_max_epu8(_mm256_max_epu8(p, _mm256_srli_epi32(p, 8)),
+                                _mm256_srli_epi32(p, 16));
+
+    return _mm256_and_si256(m, _mm256_set1_epi32(0xFF));
+}
+
+TARGET_AVX2 static inline __m256i luma8AVX2(const QRgb *in) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    __m256i b = _mm256_and_si256(p, mask);
+
+    __m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(11)),
+                                   _mm256_slli_epi32(g, 4));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(b, _mm256_set1_epi32(5)));
+
+    return _mm256_srli_epi32(sum, 5);
+}
+
+// packs 32 lanes of 0..255 ints into 32 bytes
+TARGET_AVX2 static inline void store32AVX2(uchar *out, __m256i v0, __m256i v1,
+                                           __m256i v2, __m256i v3) {
+    // the packs work within each 128-bit half, which leaves the 4 pixel groups
+    // in the order 0 2 4 6 1 3 5 7
+    __m256i p = _mm256_packus_epi16(_mm256_packus_epi32(v0, v1),
+                                    _mm256_packus_epi32(v2, v3));
+
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out),
+        _mm256_permutevar8x32_epi32(p, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)));
+}
+
+TARGET_AVX2 static void valueRowAVX2(const QRgb *in, uchar *out, int w) {
+    int x = 0;
+
+    for (; x + 32 <= w; x += 32)
+        store32AVX2(out + x, value8AVX2(in + x), value8AVX2(in + x + 8),
+                    value8AVX2(in + x + 16), value8AVX2(in + x + 24));
+
+    valueRowScalar(in + x, out + x, w - x);
+}
+
+TARGET_AVX2 static void lumaRowAVX2(const QRgb *in, uchar *out, int w) {
+    int x = 0;
+
+    for (; x + 32 <= w; x += 32)
+        store32AVX2(out + x, luma8AVX2(in + x), luma8AVX2(in + x + 8),
+                    luma8AVX2(in + x + 16), luma8AVX2(in + x + 24));
+
+    lumaRowScalar(in + x, out + x, w - x);
+}
+
+//
+// cpu detection
+//
+
+static void cpuid(int leaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+    int r[4];
+
+    __cpuidex(r, leaf, 0);
+    for (int i = 0; i < 4; ++i)
+        regs[i] = r[i];
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// is the OS saving the xmm and ymm registers on context switches?
+static bool osSavesYMM(void) {
+#if defined(_MSC_VER)
+    return (_xgetbv(0) & 6) == 6;
+#else
+    unsigned int eax, edx;
+
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (eax & 6) == 6;
+#endif
+}
+
+static void detectCpu(bool &hassse41, bool &hasavx2) {
+    unsigned int regs[4]; // eax ebx ecx edx
+
+    hassse41 = false;
+    hasavx2 = false;
+
+    cpuid(0, regs);
+    unsigned int maxleaf = regs[0];
+
+    if (maxleaf < 1)
+        return;
+
+    cpuid(1, regs);
+    hassse41 = (regs[2] & (1 << 19)) != 0;
+
+    bool hasosxsave = (regs[2] & (1 << 27)) != 0;
+    bool hasavx = (regs[2] & (1 << 28)) != 0;
+
+    if (maxleaf < 7 || !hasosxsave || !hasavx || !osSavesYMM())
+        return;
+
+    cpuid(7, regs);
+    hasavx2 = (regs[1] & (1 << 5)) != 0;
+}
+
+#endif // POCKETSCAN_X86
+
+//
+//
+// PixelKernels
+//
+//
+
+PixelKernels::PixelKernels(void) {
+    name = "scalar";
+    levelRow = levelRowScalar;
+    avgThresholdRow = avgThresholdRowScalar;
+    valueRow = valueRowScalar;
+    lumaRow = lumaRowScalar;
+    bilinearRow = bilinearRowScalar;
+
+#ifdef POCKETSCAN_X86
+    bool hassse41, hasavx2;
+
+    detectCpu(hassse41, hasavx2);
+
+    const char *cap = getenv("POCKETSCAN_SIMD");
+
+    if (cap && strcmp(cap, "scalar") == 0)
+        hassse41 = hasavx2 = false;
+    if (cap && strcmp(cap, "sse4.1") == 0)
+        hasavx2 = false;
+
+    if (hassse41) {
+        // there is no sse gather, so the table lookups stay scalar
+        // (the avx2 version uses bilinearRowSSE41 too, as its fetches
+        // are 2x2 neighbourhoods, not a good fit for gathers)
+        name = "sse4.1";
+        bilinearRow = bilinearRowSSE41;
+        avgThresholdRow = avgThresholdRowSSE41;
+        valueRow = valueRowSSE41;
+        lumaRow = lumaRowSSE41;
+    }
+    if (hasavx2) {
+        name = "avx2";
+        levelRow = levelRowAVX2;
+        avgThresholdRow = avgThresholdRowAVX2;
+        valueRow = valueRowAVX2;
+        lumaRow = lumaRowAVX2;
+    }
+#endif
+}
+
+const PixelKernels &PixelKernels::instance(void) {
+    static PixelKernels kernels;
+
+    return kernels;
+}
+
+void PixelKernels::makeLevelTable(const uchar *table, LevelTable &out) {
+    for (int i = 0; i < 256; ++i) {
+        out.red[i] = static_cast<quint32>(table[i]) << 16;
+        out.green[i] = static_cast<quint32>(table[i]) << 8;
+        out.blue[i] = table[i];
+    }
+}
+
+//
+// PixelKernels::check
+//
+
+// the widths checked, covering the vector bodies and every tail length
+static const int CHECK_MAX_WIDTH = 100;
+// the size of the (square) image the bilinear spans are in
+static const int CHECK_IMAGE_SIZE = 64;
+static const int CHECK_SPANS = 1000;
+
+// a small, fixed, pseudo random generator, so that any failure repeats
+static quint32 nextRandom(quint32 &seed) {
+    seed = seed * 1664525 + 1013904223;
+
+    return seed;
+}
+
+static bool reportMismatch(const char *kernel, const char *name, int w) {
+    fprintf(stderr, "PixelKernels: %s %s differs from scalar (width %d)\n",
+            name, kernel, w);
+
+    return false;
+}
+
+bool PixelKernels::check(void) {
+    const PixelKernels &k = instance();
+    quint32 seed = 1;
+    bool ok = true;
+
+    std::vector<QRgb> in(CHECK_MAX_WIDTH), out(CHECK_MAX_WIDTH),
+        expected(CHECK_MAX_WIDTH);
+    std::vector<uchar> out8(CHECK_MAX_WIDTH), expected8(CHECK_MAX_WIDTH);
+    uchar table[256];
+    LevelTable leveltable;
+
+    for (int i = 0; i < 256; ++i)
+        table[i] = static_cast<uchar>(nextRandom(seed) >> 24);
+    makeLevelTable(table, leveltable);
+
+    for (int w = 0; w < CHECK_MAX_WIDTH; ++w) {
+        for (int x = 0; x < w; ++x)
+            in[x] = nextRandom(seed);
+        // a grey (or nearly) row makes the threshold cases close calls
+        if (w % 2)
+            for (int x = 0; x < w; ++x)
+                in[x] = qRgb(in[x] & 0xFF, in[x] & 0xFF,
+                             (in[x] & 0xFF) ^ (x & 1));
+
+        k.levelRow(in.data(), out.data(), w, leveltable);
+        levelRowScalar(in.data(), expected.data(), w, leveltable);
+        if (!std::equal(out.begin(), out.begin() + w, expected.begin()))
+            ok = reportMismatch("levelRow", k.name, w);
+
+        int thres = nextRandom(seed) >> 24;
+        int count = k.avgThresholdRow(in.data(), out.data(), w, thres);
+
+        if (count !=
+                avgThresholdRowScalar(in.data(), expected.data(), w, thres) ||
+            !std::equal(out.begin(), out.begin() + w, expected.begin()))
+            ok = reportMismatch("avgThresholdRow", k.name, w);
+
+        k.valueRow(in.data(), out8.data(), w);
+        valueRowScalar(in.data(), expected8.data(), w);
+        if (!std::equal(out8.begin(), out8.begin() + w, expected8.begin()))
+            ok = reportMismatch("valueRow", k.name, w);
+
+        k.lumaRow(in.data(), out8.data(), w);
+        lumaRowScalar(in.data(), expected8.data(), w);
+        if (!std::equal(out8.begin(), out8.begin() + w, expected8.begin()))
+            ok = reportMismatch("lumaRow", k.name, w);
+    }
+
+    std::vector<QRgb> img(CHECK_IMAGE_SIZE * CHECK_IMAGE_SIZE);
+
+    for (size_t i = 0; i < img.size(); ++i)
+        img[i] = nextRandom(seed);
+
+    for (int s = 0; s < CHECK_SPANS; ++s) {
+        BilinearSpan span;
+        // starting in the middle, and moving less than 1.5 pixels a sample,
+        // keeps the spans (and their neighbours) within the image
+        int n = nextRandom(seed) % 21;
+        qint64 mid = static_cast<qint64>(CHECK_IMAGE_SIZE / 2 - 1)
+                     << FIXED_SHIFT;
+        qint64 half = static_cast<qint64>(1) << (FIXED_SHIFT - 1);
+
+        span.origin = img.data();
+        // every other span is transposed, as a RotatedView might be
+        span.pixstepx = s % 2 ? CHECK_IMAGE_SIZE : 1;
+        span.pixstepy = s % 2 ? 1 : CHECK_IMAGE_SIZE;
+        span.x = mid + (nextRandom(seed) >> 1);
+        span.y = mid + (nextRandom(seed) >> 1);
+        span.stepx = (static_cast<qint64>(nextRandom(seed)) - half) * 3;
+        span.stepy = (static_cast<qint64>(nextRandom(seed)) - half) * 3;
+
+        k.bilinearRow(span, out.data(), n);
+        bilinearRowScalar(span, expected.data(), n);
+        if (!std::equal(out.begin(), out.begin() + n, expected.begin()))
+            ok = reportMismatch("bilinearRow", k.name, n);
+    }
+
+    return ok;
+}
@@ -0,0 +1,108 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_PIXELKERNELS_H__
+#define __INCLUDED_POCKETSCAN_PIXELKERNELS_H__
+
+#include <QColor>
+
+/**
+ * Per row pixel kernels for 32-bit (RGB32/ARGB32) scan lines.
+ *
+ * There are SSE4.1 and AVX2 versions of the kernels, and the best one that
+ * the current cpu supports is picked at runtime (via CPUID), with a plain
+ * C++ fallback. Setting the POCKETSCAN_SIMD environment variable to "scalar"
+ * or "sse4.1" caps the choice (which, with check(), is how each version
+ * is checked against the plain one).
+ *
+ * @author Aleksander Demko
+ */
+class PixelKernels {
+  public:
+    /**
+     * A channel table (see NewLevelAlg::computeChannelTable) with each entry
+     * already shifted into place, so that a leveled pixel is just
+     * 0xFF000000 | red[r] | green[g] | blue[b]
+     *
+     * @author Aleksander Demko
+     */
+    struct LevelTable {
+        quint32 red[256], green[256], blue[256];
+    };
+
+    /**
+     * A run of bilinear samples along a straight line through a 32-bit
+     * image. Positions are 32.32 fixed point pixel coordinates, sample i
+     * being at (x + i*stepx, y + i*stepy).
+     *
+     * Pixel (px, py) is at origin[px*pixstepx + py*pixstepy], so that
+     * a RotatedView can be sampled as is.
+     *
+     * Every sample, and its right and lower neighbours, must be
+     * within the image.
+     *
+     * @author Aleksander Demko
+     */
+    struct BilinearSpan {
+        const QRgb *origin;
+        ptrdiff_t pixstepx, pixstepy;
+        qint64 x, y, stepx, stepy;
+    };
+
+    static const int FIXED_SHIFT = 32;
+
+    /// out[x] = the in[x] channels looked up in table, alpha set to opaque
+    typedef void (*LevelRowFunc)(const QRgb *in, QRgb *out, int w,
+                                 const LevelTable &table);
+    /**
+     * out[x] = white if (r+g+b)/3 > thres, black otherwise.
+     * Returns the number of white pixels
+     */
+    typedef int (*AvgThresholdRowFunc)(const QRgb *in, QRgb *out, int w,
+                                       int thres);
+    /// out[x] = the hsv value, max(r,g,b), of in[x]
+    typedef void (*ValueRowFunc)(const QRgb *in, uchar *out, int w);
+    /// out[x] = the luma, qGray(), of in[x]
+    typedef void (*LumaRowFunc)(const QRgb *in, uchar *out, int w);
+    /**
+     * out[i] = sample i of the span, for i < n, alpha set to opaque.
+     * The weights are in 256ths, so the result is within about
+     * one level of an exact bilinear sample.
+     */
+    typedef void (*BilinearRowFunc)(const BilinearSpan &span, QRgb *out,
+                                    int n);
+
+  public:
+    /// returns the kernels for this cpu
+    static const PixelKernels &instance(void);
+
+    static void makeLevelTable(const uchar *table, LevelTable &out);
+
+    /**
+     * Runs instance()'s kernels and the plain C++ ones on the same
+     * (pseudo random) rows, of many widths, and compares the results.
+     * Any differences are printed to stderr.
+     * Returns true if they all agree exactly.
+     *
+     * @author Aleksander Demko
+     */
+    static bool check(void);
+
+  public:
+    const char *name; // "avx2", "sse4.1" or "scalar"
+
+    LevelRowFunc levelRow;
+    AvgThresholdRowFunc avgThresholdRow;
+    ValueRowFunc valueRow;
+    LumaRowFunc lumaRow;
+    BilinearRowFunc bilinearRow;
+
+  private:
+    PixelKernels(void);
+};
+
+#endif
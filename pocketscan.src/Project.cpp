@@ -11,8 +11,10 @@
 #include <math.h>
 
 #include <algorithm>
+#include <memory>
 
 #include <QColor>
+#include <QDataStream>
 #include <QDebug>
 #include <QDir>
 #include <QDomDocument>
@@ -28,8 +30,12 @@
 #include <FileNameSeries.h>
 #include <ImageAlg.h>
 #include <ImageFileCache.h> // for calcAspect
+#include <ImagePyramid.h>
 #include <MainWindow.h>
 #include <MathUtil.h>
+#include <PagePipeline.h>
+#include <Stats.h>
+#include <Trace.h>
 
 using namespace hydra;
 
@@ -80,12 +86,20 @@ QImage TransformOp::apply(QImage img) {
     if (dm_rotatecode == 0)
         return img;
 
+    if (RotatedView::canView(img)) {
+        RotateAlg alg(img, dm_rotatecode);
+
+        alg.run();
+
+        return alg.output();
+    }
+
     QTransform x;
     x.rotate(dm_rotatecode * 90);
     return img.transformed(x);
 }
 
-QSize TransformOp::applySize(QSize s) {
+QSize TransformOp::applySize(QSize s) const {
     if (dm_rotatecode % 2 == 1)
         return QSize(s.height(), s.width());
     else
@@ -167,12 +181,35 @@ void ClipOp::reset(void) {
     dm_corners[3] = QPointF(0, 1);
 }
 
-QImage ClipOp::apply(QImage img, QSize maxsize) {
+QImage ClipOp::apply(QImage img, QSize maxsize, int mapping) {
     // check for fast case
     if (isReset() || dm_size != MAX_SIZE)
         return img;
 
-    InterClipAlg alg(img, dm_corners);
+    std::unique_ptr<ClipAlg> alg;
+
+    if (mapping == ClipAlg::PERSPECTIVE_MAPPING)
+        alg.reset(new PerspectiveClipAlg(img, dm_corners));
+    else
+        alg.reset(new InterClipAlg(img, dm_corners));
+
+    if (maxsize.isValid())
+        alg->resizeOutputByMax(maxsize);
+
+    alg->run();
+
+    return alg->output();
+}
+
+QImage ClipOp::apply(ImagePyramid &pyramid, QSize maxsize, int mapping) {
+    // check for fast case
+    if (isReset() || dm_size != MAX_SIZE)
+        return pyramid.base();
+
+    if (mapping != ClipAlg::QUAD_MAPPING)
+        return apply(pyramid.base(), maxsize, mapping);
+
+    InterClipAlg alg(pyramid, dm_corners);
 
     if (maxsize.isValid())
         alg.resizeOutputByMax(maxsize);
@@ -201,13 +238,30 @@ void ClipOp::loadXML(hydra::NodePath p) {
     IGNORE_NODEPATH_EXCEPTIONS(dm_size = p.getPropAsLong("size"));
 }
 
+void ClipOp::saveData(QDataStream &out) const {
+    out << static_cast<qint32>(dm_size);
+    for (int i = 0; i < MAX_SIZE; ++i)
+        out << dm_corners[i];
+}
+
+bool ClipOp::loadData(QDataStream &in) {
+    qint32 size;
+
+    in >> size;
+    for (int i = 0; i < MAX_SIZE; ++i)
+        in >> dm_corners[i];
+    dm_size = size;
+
+    return in.status() == QDataStream::Ok && size >= 0 && size <= MAX_SIZE;
+}
+
 //
 //
 // Histogram
 //
 //
 
-Histogram::Histogram(void) { dm_countmax = -1; }
+Histogram::Histogram(void) { dm_countmax.fill(-1); }
 
 Histogram::Histogram(const QImage &img) { computeHistogram(img); }
 
@@ -216,17 +270,19 @@ void Histogram::computeHistogram(const QImage &img) {
 
     alg.run();
 
-    dm_count = alg.countArray();
-    dm_countmax = alg.countMax();
+    dm_count = alg.channels();
+    dm_countmax = alg.countMaxes();
 }
 
-void Histogram::meanAndStdDev(double &mean, double &stddev) const {
+void Histogram::meanAndStdDev(double &mean, double &stddev,
+                              int channel) const {
+    const HistoAlg::HistoArray &counts = dm_count[channel];
     double sum = 0;
     int count = 0;
 
     for (int bin = 0; bin < HistoAlg::SIZE; ++bin) {
-        sum += bin * dm_count[bin];
-        count += dm_count[bin];
+        sum += bin * counts[bin];
+        count += counts[bin];
     }
 
     if (count == 0) {
@@ -239,19 +295,51 @@ void Histogram::meanAndStdDev(double &mean, double &stddev) const {
     sum = 0;
     for (int bin = 0; bin < HistoAlg::SIZE; ++bin) {
         double diff = (bin - mean);
-        sum += diff * diff * dm_count[bin];
+        sum += diff * diff * counts[bin];
     }
 
     stddev = sqrt(sum / count);
 }
 
+void Histogram::saveData(QDataStream &out) const {
+    out << static_cast<qint32>(HistoAlg::NUM_CHANNELS)
+        << static_cast<qint32>(HistoAlg::SIZE);
+
+    for (int c = 0; c < HistoAlg::NUM_CHANNELS; ++c) {
+        out << static_cast<qint32>(dm_countmax[c]);
+        for (int bin = 0; bin < HistoAlg::SIZE; ++bin)
+            out << static_cast<qint32>(dm_count[c][bin]);
+    }
+}
+
+bool Histogram::loadData(QDataStream &in) {
+    qint32 numchannels, size, v;
+
+    in >> numchannels >> size;
+    if (numchannels != HistoAlg::NUM_CHANNELS || size != HistoAlg::SIZE)
+        return false;
+
+    for (int c = 0; c < HistoAlg::NUM_CHANNELS; ++c) {
+        in >> v;
+        dm_countmax[c] = v;
+        for (int bin = 0; bin < HistoAlg::SIZE; ++bin) {
+            in >> v;
+            dm_count[c][bin] = v;
+        }
+    }
+
+    return in.status() == QDataStream::Ok;
+}
+
 //
 //
 // LevelOp
 //
 //
 
-LevelOp::LevelOp(void) { setMagicValue(LevelAlg::WHITE / 2); }
+LevelOp::LevelOp(void) : dm_tablevalid(false) {
+    setMagicValue(LevelAlg::WHITE / 2);
+}
 
 void LevelOp::reset(void) {
     dm_marks[0] = 0;
@@ -271,13 +359,25 @@ QImage LevelOp::apply(QImage img) {
     if (isReset())
         return img;
 
-    LevelAlg alg(img, dm_marks, dm_range);
+    LevelAlg alg(img, table());
 
     alg.run();
 
     return alg.output();
 }
 
+const LevelAlg::ChannelTable &LevelOp::table(void) const {
+    if (!dm_tablevalid || dm_tablemarks != dm_marks ||
+        dm_tablerange != dm_range) {
+        LevelAlg::computeChannelTable(dm_marks, dm_range, dm_table);
+        dm_tablemarks = dm_marks;
+        dm_tablerange = dm_range;
+        dm_tablevalid = true;
+    }
+
+    return dm_table;
+}
+
 void LevelOp::setMagicValue(int mid) {
     dm_marks[0] = mid - 20;
     dm_marks[1] = mid;
@@ -396,6 +496,37 @@ void StepList::init(int edition) {
 //
 //
 
+// the size imageShrink() shrinks to
+static QSize imageShrinkSize(const QSize &size) {
+    return calcAspectEven(size,
+                          QSize(Project::FileEntry::AUTO_CLIP_SIZE,
+                                Project::FileEntry::AUTO_CLIP_SIZE),
+                          false);
+}
+
+static QImage imageShrink(const QImage &img) {
+    /*QSize s(img.size());
+    QSize ideal(400,400);
+
+    if (s.isEmpty())
+      return img;
+
+    while (s.width() > ideal.width() || s.height() > ideal.height()) {
+      s.rwidth() /= 2;
+      s.rheight() /= 2;
+    }*/
+    QSize s = imageShrinkSize(img.size());
+    // qDebug() << img.size() << s;
+
+    if (s != img.size())
+        return img.scaled(s, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    else
+        return img;
+}
+
+// above this, auto levels aren't recommended
+static const double AUTO_LEVEL_MAX_STDDEV = 30;
+
 Project::FileEntry::FileEntry(void) {
     didExifCheck = false;
     didClipCheck = false;
@@ -460,7 +591,41 @@ bool Project::FileEntry::computeAutoLevelOp(const Histogram &his,
     // new version that uses the magic thing
     outputop.setMagicValue(mean - 1.5 * stddev);
 
-    return stddev <= 30;
+    return stddev <= AUTO_LEVEL_MAX_STDDEV;
+}
+
+QImage Project::FileEntry::renderPage(const QImage &src, int clipmapping) {
+    if (!PageAlg::canRender(src)) {
+        // the old, one image per step way
+        QImage img = transformOp.apply(src);
+
+        img = clipOp.apply(img, QSize(), clipmapping);
+        if (usingLevel)
+            img = levelOp.apply(img);
+
+        return img;
+    }
+
+    // same fast cases as in ClipOp::apply() and LevelOp::apply()
+    bool doclip = !clipOp.isReset() && clipOp.size() == ClipOp::MAX_SIZE;
+    bool dolevel = usingLevel && !levelOp.isReset();
+
+    if (rendersAsIs())
+        return src;
+
+    PageAlg alg(src, transformOp.rotateCode(), doclip ? &clipOp.corners() : 0,
+                dolevel ? &levelOp.table() : 0, clipmapping);
+
+    alg.run();
+
+    return alg.output();
+}
+
+bool Project::FileEntry::rendersAsIs(void) const {
+    bool doclip = !clipOp.isReset() && clipOp.size() == ClipOp::MAX_SIZE;
+    bool dolevel = usingLevel && !levelOp.isReset();
+
+    return transformOp.rotateCode() == 0 && !doclip && !dolevel;
 }
 
 void Project::FileEntry::saveXML(hydra::NodePath p, const QString &projectdir) {
@@ -519,7 +684,13 @@ bool Project::FileEntry::loadXML(hydra::NodePath p, const QString &projectdir) {
 //
 //
 
-Project::Project(void) { clear(); }
+Project::Project(void)
+    : dm_pagepool(0), dm_pagebudget(0), dm_sharedfilecache(0),
+      dm_shareddiskcache(0), dm_exportlookahead(0) {
+    dm_filecache.setDiskCache(&dm_diskcache);
+
+    clear();
+}
 
 void Project::setFileName(const QString &fileName) { dm_filename = fileName; }
 
@@ -551,6 +722,9 @@ void Project::clear(void) {
     dm_filename.clear();
     dm_files.clear();
     dm_step = 0;
+    dm_clipmapping = ClipAlg::QUAD_MAPPING;
+    dm_exportdpi = DEFAULT_EXPORT_DPI;
+    dm_stagecache.clear();
 }
 
 void Project::appendFiles(const QStringList &_filenames) {
@@ -578,41 +752,235 @@ void Project::notifyChange(Listener *source) {
         (*ii)->handleProjectChanged(source);
 }
 
-// im unsure if this helps
-#define YIELD                                                                  \
-    if (progdlg) {                                                             \
-        progdlg->setValue(pageno);                                             \
+QSize Project::analysisSourceSize(const QSize &filesize) {
+    return calcAspect(filesize, QSize(ANALYZE_SIZE, ANALYZE_SIZE), false);
+}
+
+QSize Project::analysisSize(const FileEntry &entry) {
+    return calcAspect(
+        entry.transformOp.applySize(fileCache().imageSize(entry.fileName)),
+        QSize(ANALYZE_SIZE, ANALYZE_SIZE), false);
+}
+
+QImage Project::analysisImage(const FileEntry &entry) {
+    ImageFileCache &cache = fileCache();
+    QSize size(analysisSize(entry));
+    std::shared_ptr<QImage> src(cache.getImage(
+        entry.fileName, analysisSourceSize(cache.imageSize(entry.fileName))));
+    QImage img = entry.transformOp.apply(*src);
+
+    if (img.size() != size && !img.isNull())
+        img = img.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+    return img;
+}
+
+bool Project::computeAutoClipOp(const FileEntry &entry, ClipOp &outputop,
+                                QImage *analysisimg) {
+    // keyed on the size alone, so that a hit needs no decode
+    QSize shrunksize(imageShrinkSize(analysisSize(entry)));
+    QString item(QString("autoclip %1 %2x%3")
+                     .arg(entry.transformOp.rotateCode())
+                     .arg(shrunksize.width())
+                     .arg(shrunksize.height()));
+    QByteArray data;
+    qint32 found;
+
+    if (diskCache().load(entry.fileName, item, data)) {
+        QDataStream in(data);
+
+        in >> found;
+        if (outputop.loadData(in))
+            return found != 0;
     }
 
-bool Project::exportToPrinter(QPrinter *printer, QProgressDialog *progdlg) {
-    // parallel processing?
-    /*QPrinter printer(QPrinter::HighResolution);
-    printer.setOutputFileName(filename);
-    printer.setPageSize(QPrinter::Letter);*/
+    QImage img;
 
+    if (analysisimg && !analysisimg->isNull())
+        img = *analysisimg;
+    else {
+        img = analysisImage(entry);
+        if (analysisimg)
+            *analysisimg = img;
+    }
+
+    found = FileEntry::computeAutoClipOp(imageShrink(img), outputop);
+    data.clear();
+
+    QDataStream out(&data, QIODevice::WriteOnly);
+
+    out << found;
+    outputop.saveData(out);
+    diskCache().store(entry.fileName, item, data);
+
+    return found != 0;
+}
+
+bool Project::computeAutoLevelOp(const FileEntry &entry, LevelOp &outputop,
+                                 QImage *analysisimg) {
+    QSize size(analysisSize(entry));
+    QString item(QString("analysis histogram %1 %2x%3")
+                     .arg(entry.transformOp.rotateCode())
+                     .arg(size.width())
+                     .arg(size.height()));
+
+    if (entry.usingClip) {
+        item += " clip " + QString::number(dm_clipmapping);
+        for (int i = 0; i < entry.clipOp.size(); ++i)
+            item += QString(" %1,%2")
+                        .arg(entry.clipOp[i].x())
+                        .arg(entry.clipOp[i].y());
+    }
+
+    Histogram his;
+    QByteArray data;
+    bool loaded = false;
+
+    if (diskCache().load(entry.fileName, item, data)) {
+        QDataStream in(data);
+
+        loaded = his.loadData(in);
+    }
+
+    if (!loaded) {
+        QImage img;
+
+        if (analysisimg && !analysisimg->isNull())
+            img = *analysisimg;
+        else {
+            img = analysisImage(entry);
+            if (analysisimg)
+                *analysisimg = img;
+        }
+
+        if (entry.usingClip)
+            img = entry.clipOp.apply(img, QSize(), dm_clipmapping);
+        his.computeHistogram(img);
+        data.clear();
+
+        QDataStream out(&data, QIODevice::WriteOnly);
+
+        his.saveData(out);
+        diskCache().store(entry.fileName, item, data);
+    }
+
+    return FileEntry::computeAutoLevelOp(his, outputop);
+}
+
+bool Project::autoAnalyze(ExportProgress *progress) {
+    PagePipeline pipeline(dm_pagepool, dm_pagebudget);
+
+    if (progress)
+        progress->setPageCount(dm_files.size());
+
+    PagePipeline::PageFunc work = [&](int pageno) {
+        FileEntry &entry = dm_files[pageno];
+
+        if (!entry.didExifCheck) {
+            entry.didExifCheck = true;
+            entry.transformOp = entry.computeAutoTransformOp();
+        }
+        if (entry.didClipCheck && entry.didlevelCheck)
+            return QImage();
+
+        StatsTimer timer("analyze.page_ms");
+        TRACE_SCOPE("analyze page");
+        // only made if a check misses the disk cache, then shared by both
+        QImage img;
+
+        // in the same order as the GUI's steps, clip then level
+        if (!entry.didClipCheck) {
+            entry.didClipCheck = true;
+            ClipOp newclip;
+            if (computeAutoClipOp(entry, newclip, &img)) {
+                entry.usingClip = true;
+                entry.clipOp = newclip;
+            }
+        }
+        if (!entry.didlevelCheck) {
+            entry.didlevelCheck = true;
+            LevelOp newop;
+            if (computeAutoLevelOp(entry, newop, &img)) {
+                entry.usingLevel = true;
+                entry.levelOp = newop;
+            }
+        }
+        Stats::add("analyze.pages");
+
+        return QImage();
+    };
+
+    return pipeline.run(dm_files.size(), work, PagePipeline::CostFunc(),
+                        PagePipeline::DoneFunc(), progress);
+}
+
+// roughly the memory a page holds while its being worked on: the decoded
+// source and the rendered page
+static qint64 pageCost(ImageFileCache &cache, const QString &fileName) {
+    QSize s(cache.imageSize(fileName));
+
+    return static_cast<qint64>(s.width()) * s.height() * 4 * 2;
+}
+
+bool Project::exportToPrinter(QPrinter *printer, ExportProgress *progress) {
     QPainter dc(printer);
+    PagePipeline pipeline(dm_pagepool, dm_pagebudget);
+
+    if (dm_exportlookahead > 0)
+        pipeline.setMaxPages(dm_exportlookahead);
+
+    if (progress)
+        progress->setPageCount(dm_files.size());
+
+    // QSize outputSize = printer.pageRect().size();
+    QSize outputSize(dc.device()->width(), dc.device()->height());
+    // the most pixels worth putting on a page
+    QSize pixelSize(outputSize);
 
-    if (progdlg)
-        progdlg->setRange(0, dm_files.size());
+    if (dm_exportdpi > 0 && dm_exportdpi < printer->resolution())
+        pixelSize = QSize(static_cast<qint64>(outputSize.width()) *
+                              dm_exportdpi / printer->resolution(),
+                          static_cast<qint64>(outputSize.height()) *
+                              dm_exportdpi / printer->resolution());
 
-    for (int pageno = 0; pageno < dm_files.size(); ++pageno) {
+    // everything up to the drawing is done on the pipeline's threads, a
+    // few pages ahead of the painter
+    PagePipeline::PageFunc work = [&](int pageno) {
         FileEntry &entry = dm_files[pageno];
 
-        // dc.drawText(100, 100, entry.fileName);
+        StatsTimer timer("print.prepare_ms");
+        TRACE_SCOPE("print prepare");
+        TraceScope stage("decode");
 
-        YIELD;
-        QImage img = *fileCache().getImage(entry.fileName).get();
-        YIELD;
-        img = entry.transformOp.apply(img);
-        YIELD;
-        img = entry.clipOp.apply(img);
-        YIELD;
-        if (entry.usingLevel)
-            img = entry.levelOp.apply(img);
-        YIELD;
+        std::shared_ptr<QImage> src(fileCache().getImage(entry.fileName));
+        timer.lap("print.decode_ms");
+        stage.next("render");
+        QImage img = entry.renderPage(*src, dm_clipmapping);
+        timer.lap("print.render_ms");
 
-        // QSize outputSize = printer.pageRect().size();
-        QSize outputSize(dc.device()->width(), dc.device()->height());
+        // shrink it to the export resolution, if its bigger, so the
+        // painter (and the PDF) dont get more pixels than the page shows.
+        // smaller ones are left to the painter (and the printer) to scale up
+        QSize scaledSize = calcAspect(img.size(), pixelSize, true);
+
+        if (scaledSize.width() < img.width() && !scaledSize.isEmpty()) {
+            stage.next("scale");
+            ScaleAlg alg(img, scaledSize);
+
+            alg.run();
+            img = alg.output();
+            timer.lap("print.scale_ms");
+        }
+
+        return img;
+    };
+    PagePipeline::CostFunc cost = [&](int pageno) {
+        return pageCost(fileCache(), dm_files[pageno].fileName);
+    };
+    // while the painter is only ever used here, on this thread
+    PagePipeline::DoneFunc paint = [&](int pageno, const QImage &img) {
+        StatsTimer timer("print.paint_ms");
+        TRACE_SCOPE("print paint");
 
         QSize actualSize = calcAspect(img.size(), outputSize, true);
         // QPoint topLeft(printer.pageRect().topLeft());
@@ -622,59 +990,159 @@ bool Project::exportToPrinter(QPrinter *printer, QProgressDialog *progdlg) {
         topLeft.ry() += (outputSize.height() - actualSize.height()) / 2;
 
         dc.drawImage(QRect(topLeft, actualSize), img);
+        Stats::add("print.pages");
 
-        /*img = img.scaled(outputSize, Qt::KeepAspectRatio,
-        Qt::SmoothTransformation);
+        if (pageno + 1 < dm_files.size())
+            printer->newPage();
 
-        QPoint topLeft(printer.pageRect().topLeft());
+        return true;
+    };
+
+    return pipeline.run(dm_files.size(), work, cost, paint, progress);
+}
 
-        topLeft.rx() += (outputSize.width() - img.width()) / 2;
-        topLeft.ry() += (outputSize.height() - img.height()) / 2;
+bool Project::exportToPdf(const QString &filename, ExportProgress *progress,
+                          int quality) {
+    PdfWriter pdf;
+    PagePipeline pipeline(dm_pagepool, dm_pagebudget);
+    // the encoded pages, between the pipeline's threads and the writer
+    std::vector<PdfWriter::Image> images(dm_files.size());
+    // the most pixels worth putting on a page
+    QSize pixelSize(PdfWriter::LETTER_WIDTH, PdfWriter::LETTER_HEIGHT);
 
-        dc.drawImage(QRect(topLeft, img.size()), img);*/
+    if (dm_exportdpi > 0)
+        pixelSize = QSize(PdfWriter::LETTER_WIDTH * dm_exportdpi / 72,
+                          PdfWriter::LETTER_HEIGHT * dm_exportdpi / 72);
 
-        if (progdlg) {
-            progdlg->setValue(pageno + 1);
-            if (progdlg->wasCanceled())
-                return false;
+    if (!pdf.open(filename))
+        return false;
+
+    if (dm_exportlookahead > 0)
+        pipeline.setMaxPages(dm_exportlookahead);
+
+    if (progress)
+        progress->setPageCount(dm_files.size());
+
+    PagePipeline::PageFunc work = [&](int pageno) {
+        FileEntry &entry = dm_files[pageno];
+        PdfWriter::Image &out = images[pageno];
+
+        StatsTimer timer("pdf.page_ms");
+        TRACE_SCOPE("pdf page");
+
+        if (entry.rendersAsIs()) {
+            // an untouched JPEG goes in as is, no decoding or encoding
+            QFile f(entry.fileName);
+
+            if (f.open(QIODevice::ReadOnly) && f.peek(2) == "\xFF\xD8" &&
+                PdfWriter::jpegImage(f.readAll(), out)) {
+                timer.lap("pdf.passthrough_ms");
+                Stats::add("pdf.passthrough_pages");
+                return QImage();
+            }
         }
-        if (pageno + 1 < dm_files.size())
-            printer->newPage();
+
+        TraceScope stage("decode");
+        std::shared_ptr<QImage> src(fileCache().getImage(entry.fileName));
+        timer.lap("pdf.decode_ms");
+        stage.next("render");
+        QImage img = entry.renderPage(*src, dm_clipmapping);
+        timer.lap("pdf.render_ms");
+
+        QSize scaledSize = calcAspect(img.size(), pixelSize, true);
+
+        if (dm_exportdpi > 0 && scaledSize.width() < img.width() &&
+            !scaledSize.isEmpty()) {
+            stage.next("scale");
+            ScaleAlg alg(img, scaledSize);
+
+            alg.run();
+            img = alg.output();
+            timer.lap("pdf.scale_ms");
+        }
+
+        stage.next("encode");
+        if (entry.usingLevel && PdfWriter::isBilevel(img)) {
+            PdfWriter::bilevelImage(img, out);
+            Stats::add("pdf.bilevel_pages");
+        } else {
+            PdfWriter::jpegImage(img, quality, out);
+            Stats::add("pdf.jpeg_pages");
+        }
+        timer.lap("pdf.encode_ms");
+
+        return QImage();
+    };
+    PagePipeline::CostFunc cost = [&](int pageno) {
+        return pageCost(fileCache(), dm_files[pageno].fileName);
+    };
+    // pages are written in order, and dropped once written
+    PagePipeline::DoneFunc write = [&](int pageno, const QImage &) {
+        TRACE_SCOPE("pdf write");
+        bool ok = pdf.addPage(images[pageno]);
+
+        images[pageno] = PdfWriter::Image();
+
+        return ok;
+    };
+
+    if (!pipeline.run(dm_files.size(), work, cost, write, progress) ||
+        !pdf.close()) {
+        pdf.abort();
+        return false;
     }
+
     return true;
 }
 
 bool Project::exportToFiles(const QString &seedFilename,
-                            QProgressDialog *progdlg) {
+                            ExportProgress *progress) {
     FileNameSeries filenames(seedFilename);
+    QStringList outfilenames;
+    PagePipeline pipeline(dm_pagepool, dm_pagebudget);
+    std::vector<char> saved(dm_files.size(), 0);
+
+    for (int pageno = 0; pageno < dm_files.size(); ++pageno)
+        outfilenames.append(filenames.fileNameAt(pageno));
+
+    if (dm_exportlookahead > 0)
+        pipeline.setMaxPages(dm_exportlookahead);
 
-    if (progdlg)
-        progdlg->setRange(0, dm_files.size());
+    if (progress)
+        progress->setPageCount(dm_files.size());
 
-    for (int pageno = 0; pageno < dm_files.size(); ++pageno) {
+    // each page is decoded, rendered and saved on one of the pipeline's
+    // threads, with several pages on the go at once
+    PagePipeline::PageFunc work = [&](int pageno) {
         FileEntry &entry = dm_files[pageno];
-        QString outfilename(filenames.fileNameAt(pageno));
-
-        YIELD;
-        QImage img = *fileCache().getImage(entry.fileName).get();
-        YIELD;
-        img = entry.transformOp.apply(img);
-        YIELD;
-        img = entry.clipOp.apply(img);
-        YIELD;
-        if (entry.usingLevel)
-            img = entry.levelOp.apply(img);
-        YIELD;
-
-        img.save(outfilename);
-
-        if (progdlg) {
-            progdlg->setValue(pageno + 1);
-            if (progdlg->wasCanceled())
-                return false;
-        }
-    }
-    return true;
+
+        StatsTimer timer("export.page_ms");
+        TRACE_SCOPE("export page");
+        TraceScope stage("decode");
+
+        std::shared_ptr<QImage> src(fileCache().getImage(entry.fileName));
+        timer.lap("export.decode_ms");
+        stage.next("render");
+        QImage img = entry.renderPage(*src, dm_clipmapping);
+        timer.lap("export.render_ms");
+        stage.next("save");
+
+        saved[pageno] = img.save(outfilenames[pageno]);
+        timer.lap("export.save_ms");
+        Stats::add("export.pages");
+
+        return QImage();
+    };
+    PagePipeline::CostFunc cost = [&](int pageno) {
+        return pageCost(fileCache(), dm_files[pageno].fileName);
+    };
+
+    // stop at the first page that couldnt be saved
+    PagePipeline::DoneFunc done = [&](int pageno, const QImage &) {
+        return saved[pageno] != 0;
+    };
+
+    return pipeline.run(dm_files.size(), work, cost, done, progress);
 }
 
 bool Project::saveXML(const QString &filename) {
@@ -711,6 +1179,8 @@ void Project::saveXML(hydra::NodePath p, const QString &projectdir) {
     p.erase("images");
 
     p["step"].setPropVal("current", dm_step);
+    p["clip"].setPropVal("mapping", dm_clipmapping);
+    p["export"].setPropVal("dpi", dm_exportdpi);
 
     NodePath images = p["images"];
 
@@ -746,9 +1216,19 @@ void Project::loadXML(hydra::NodePath p, const QString &projectdir) {
 
     // just incase the file has a step setting for a step we dont have
     // (such as loading an Ultimate made file in Standard
-    if (MainWindow::instance()->stepList().indexOf(dm_step) == -1)
+    // (there is no MainWindow in batch mode, where the step doesnt matter)
+    if (MainWindow::instance() &&
+        MainWindow::instance()->stepList().indexOf(dm_step) == -1)
         dm_step = 0;
 
+    dm_clipmapping = ClipAlg::QUAD_MAPPING;
+    IGNORE_NODEPATH_EXCEPTIONS(
+        dm_clipmapping = p("clip").getPropAsLong("mapping");)
+
+    dm_exportdpi = DEFAULT_EXPORT_DPI;
+    IGNORE_NODEPATH_EXCEPTIONS(
+        dm_exportdpi = p("export").getPropAsLong("dpi");)
+
     if (images.hasChild("image")) {
         NodePath image(images("image"));
 
@@ -13,13 +13,20 @@
 
 #include <ImageAlg.h>
 
-#include <QProgressDialog>
 #include <QPrinter>
 #include <QString>
 
 #include <hydra/NodePath.h>
 
+#include <DiskCache.h>
+#include <ExportProgress.h>
 #include <ImageFileCache.h>
+#include <PagePipeline.h>
+#include <PdfWriter.h>
+#include <StageCache.h>
+
+class ImagePyramid;
+class QDataStream;
 
 /**
  * Listens to changes to the Project object.
@@ -44,11 +51,13 @@ class TransformOp {
 
     // similar to apply(), but applies the rotation to the size params instead
     // (ie width-height might be swapped)
-    QSize applySize(QSize s);
+    QSize applySize(QSize s) const;
 
     void rotateLeft(void);
     void rotateRight(void);
 
+    int rotateCode(void) const { return dm_rotatecode; }
+
     // future TODO: flip operations (does this make sense for this app?
 
     void saveXML(hydra::NodePath p);
@@ -77,7 +86,19 @@ class ClipOp {
     // order the 4 points to topleft,topright,botleft,botright fasion
     void rearrange(void);
 
-    QImage apply(QImage img, QSize maxsize = QSize());
+    /// mapping is one of the ClipAlg mappings, see Project::clipMapping()
+    QImage apply(QImage img, QSize maxsize = QSize(),
+                 int mapping = ClipAlg::QUAD_MAPPING);
+    /**
+     * Same as above, but clips the base of the given pyramid, sampling
+     * from its smaller levels where the output is smaller than the
+     * source (see InterClipAlg).
+     * The perspective mapping doesn't do this (yet), and just clips the base.
+     *
+     * @author Aleksander Demko
+     */
+    QImage apply(ImagePyramid &pyramid, QSize maxsize,
+                 int mapping = ClipAlg::QUAD_MAPPING);
 
     QPointF operator[](int index) const { return dm_corners[index]; }
 
@@ -93,6 +114,11 @@ class ClipOp {
 
     void loadXML(hydra::NodePath p);
 
+    /// binary versions of the above, for the DiskCache
+    void saveData(QDataStream &out) const;
+    /// returns false on errors
+    bool loadData(QDataStream &in);
+
   private:
     ClipAlg::PointFArray
         dm_corners; // topleft, topright, botright, botleft, respectivly
@@ -103,6 +129,7 @@ class ClipOp {
 
 /**
  * A statistical histogram.
+ * All the HistoAlg channels are kept, the default being the hsv-values.
  *
  * @author Aleksander Demko
  */
@@ -110,25 +137,44 @@ class Histogram {
   public:
     /// construct a null/empty histogram
     Histogram(void);
-    /// build a histogram from the hsv-values from the image
+    /// build a histogram from the image
     Histogram(const QImage &img);
 
-    bool isNull(void) const { return dm_countmax == -1; }
+    bool isNull(void) const {
+        return dm_countmax[HistoAlg::VALUE_CHANNEL] == -1;
+    }
 
     void computeHistogram(const QImage &img);
 
-    int operator[](int index) const { return dm_count[index]; }
+    int operator[](int index) const {
+        return dm_count[HistoAlg::VALUE_CHANNEL][index];
+    }
 
-    int &operator[](int index) { return dm_count[index]; }
+    int &operator[](int index) {
+        return dm_count[HistoAlg::VALUE_CHANNEL][index];
+    }
 
-    int countMax(void) const { return dm_countmax; }
+    /// returns the counts of one of the HistoAlg channels
+    const HistoAlg::HistoArray &channel(int channel) const {
+        return dm_count[channel];
+    }
+
+    int countMax(int channel = HistoAlg::VALUE_CHANNEL) const {
+        return dm_countmax[channel];
+    }
 
     // calcs based on the histogram... therefore relativly fast
-    void meanAndStdDev(double &mean, double &stddev) const;
+    void meanAndStdDev(double &mean, double &stddev,
+                       int channel = HistoAlg::VALUE_CHANNEL) const;
+
+    /// saves the histogram, for the DiskCache
+    void saveData(QDataStream &out) const;
+    /// returns false on errors
+    bool loadData(QDataStream &in);
 
   private:
-    HistoAlg::HistoArray dm_count;
-    int dm_countmax;
+    HistoAlg::ChannelArray dm_count;
+    HistoAlg::MaxArray dm_countmax;
 };
 
 /**
@@ -169,6 +215,14 @@ class LevelOp {
     LevelAlg::RangeArray &range(void) { return dm_range; }
     const LevelAlg::RangeArray &range(void) const { return dm_range; }
 
+    /**
+     * Returns the channel table for the current marks and range.
+     * This is only recomputed when those change.
+     *
+     * @author Aleksander Demko
+     */
+    const LevelAlg::ChannelTable &table(void) const;
+
     /**
      * Sets the mid (gray level) of the levels, and magically
      * sets the other two values accordingly.
@@ -197,6 +251,12 @@ class LevelOp {
   private:
     LevelAlg::MarkArray dm_marks;
     LevelAlg::RangeArray dm_range;
+
+    // table() cache, and the marks and range it was computed for
+    mutable bool dm_tablevalid;
+    mutable LevelAlg::MarkArray dm_tablemarks;
+    mutable LevelAlg::RangeArray dm_tablerange;
+    mutable LevelAlg::ChannelTable dm_table;
 };
 
 /**
@@ -263,11 +323,27 @@ class Project {
 
         static bool computeAutoClipOp(const QImage &shrunkimage,
                                       ClipOp &outputop, QImage *outimg = 0);
+        /// the auto clip is done on images shrunk to fit this square
+        static const int AUTO_CLIP_SIZE = 400;
 
         // computes autoLevelOp
         // returns true if it is recommended to use it
         static bool computeAutoLevelOp(const Histogram &his, LevelOp &outputop);
 
+        /**
+         * Renders the final, exportable page (transformOp, clipOp and if
+         * usingLevel, levelOp) from the given decoded source image.
+         *
+         * This is done in one pass via PageAlg when possible.
+         * clipmapping is one of the ClipAlg mappings.
+         *
+         * @author Aleksander Demko
+         */
+        QImage renderPage(const QImage &src, int clipmapping);
+
+        /// would renderPage() return its source as is?
+        bool rendersAsIs(void) const;
+
         // throws NodePath errors options
         void saveXML(hydra::NodePath p, const QString &projectdir);
 
@@ -313,7 +389,15 @@ class Project {
      */
     int isDuplicate(int index);
 
-    ImageFileCache &fileCache(void) { return dm_filecache; }
+    ImageFileCache &fileCache(void) {
+        return dm_sharedfilecache ? *dm_sharedfilecache : dm_filecache;
+    }
+    /// the persistent cache of previews and per page results
+    DiskCache &diskCache(void) {
+        return dm_shareddiskcache ? *dm_shareddiskcache : dm_diskcache;
+    }
+    /// the memo of the preview pipeline's stage outputs
+    StageCache &stageCache(void) { return dm_stagecache; }
 
     void clear(void);
     void appendFiles(const QStringList &_filenames);
@@ -322,17 +406,157 @@ class Project {
     void setStep(int newstep) { dm_step = newstep; }
     int step(void) const { return dm_step; }
 
+    /**
+     * How the ClipOps of this book map the page, one of the ClipAlg mappings
+     * (ClipAlg::QUAD_MAPPING by default).
+     * caller should call notifyChange after setting it
+     *
+     * @author Aleksander Demko
+     */
+    void setClipMapping(int mapping) { dm_clipmapping = mapping; }
+    int clipMapping(void) const { return dm_clipmapping; }
+
+    static const int DEFAULT_EXPORT_DPI = 300;
+
+    /**
+     * The resolution pages are printed (and put into PDFs) at, at most.
+     * Bigger pages are shrunk down to it before being drawn. 0 means
+     * the printer's own resolution.
+     *
+     * @author Aleksander Demko
+     */
+    void setExportDpi(int dpi) { dm_exportdpi = dpi; }
+    int exportDpi(void) const { return dm_exportdpi; }
+
     void addListener(Listener *l);
     void removeListener(Listener *l);
 
     // source may be null
     void notifyChange(Listener *source);
 
-    /// returns true on success (user abort = failure)
-    bool exportToPrinter(QPrinter *printer, QProgressDialog *progdlg = 0);
-    /// returns true on success (user abort = failure)
+    /**
+     * Has autoAnalyze and the exports work on their pages with the given
+     * pool and budget (which may be shared with other Projects), rather
+     * than the global pool and their own budget. Null for those.
+     *
+     * @author Aleksander Demko
+     */
+    void setPagePool(QThreadPool *pool, PagePipeline::Budget *budget) {
+        dm_pagepool = pool;
+        dm_pagebudget = budget;
+    }
+
+    /**
+     * Has fileCache() be the given cache (which may be shared with other
+     * Projects, so that they all decode within one budget) rather than the
+     * Project's own. Null for its own. Should be set before anything is
+     * loaded.
+     *
+     * @author Aleksander Demko
+     */
+    void setFileCache(ImageFileCache *cache) { dm_sharedfilecache = cache; }
+    /**
+     * Has diskCache() be the given cache rather than the Project's own,
+     * so that Projects working on the same cache directory share its size
+     * accounting (give the shared fileCache() the same one). Null for its
+     * own. Should be set before anything is loaded.
+     *
+     * @author Aleksander Demko
+     */
+    void setDiskCache(DiskCache *cache) { dm_shareddiskcache = cache; }
+
+    /**
+     * How many pages the exports may prepare ahead of the one being
+     * written, at most (0, the default, for PagePipeline's own). A tuning
+     * knob for the machine, so not saved with the book.
+     *
+     * @author Aleksander Demko
+     */
+    void setExportLookahead(int pages) { dm_exportlookahead = pages; }
+    int exportLookahead(void) const { return dm_exportlookahead; }
+
+    static const int ANALYZE_SIZE = 1024;
+
+    /// the size of the decode analysisImage() is made from, for a file
+    /// of the given size (for prefetching)
+    static QSize analysisSourceSize(const QSize &filesize);
+    /// the size of analysisImage(), without making it
+    QSize analysisSize(const FileEntry &entry);
+
+    /**
+     * The image the automatic clip and level checks are done on, by both
+     * the GUI and autoAnalyze: the page rotated by its transformOp and
+     * scaled to fit ANALYZE_SIZE (never up).
+     *
+     * It is scaled from whatever decode the file cache has (or makes) of at
+     * least that size, so its pixels may vary slightly with what was
+     * decoded before. Its size doesn't.
+     *
+     * @author Aleksander Demko
+     */
+    QImage analysisImage(const FileEntry &entry);
+
+    /**
+     * Computes the auto clip of the given page from its analysisImage
+     * (shrunk to fit AUTO_CLIP_SIZE), the result being kept in the disk
+     * cache. The analysisImage is only made if the result isn't there.
+     * If analysisimg is given, its used if not null, or else set to the
+     * analysisImage if it had to be made (so that it can be passed on).
+     * Returns true if a clip was found.
+     *
+     * @author Aleksander Demko
+     */
+    bool computeAutoClipOp(const FileEntry &entry, ClipOp &outputop,
+                           QImage *analysisimg = 0);
+
+    /**
+     * Computes the auto levels of the given page from the histogram of its
+     * analysisImage (clipped, if the page is usingClip), which is kept in
+     * the disk cache. analysisimg is as in computeAutoClipOp.
+     * Returns true if its recommended to use them.
+     *
+     * @author Aleksander Demko
+     */
+    bool computeAutoLevelOp(const FileEntry &entry, LevelOp &outputop,
+                            QImage *analysisimg = 0);
+
+    /**
+     * Runs the automatic checks (EXIF rotation, clip and level
+     * detection) that haven't been done on the pages yet, in parallel.
+     * This is what the GUI does as each page is first shown, for books that
+     * are exported without being shown (in batch mode). Like in the GUI,
+     * the checks are done on analysisImage().
+     *
+     * Returns true on success (user abort = failure).
+     *
+     * @author Aleksander Demko
+     */
+    bool autoAnalyze(ExportProgress *progress = 0);
+
+    /**
+     * Prints all the pages. They are prepared (up to the drawing) in
+     * parallel, exportLookahead() pages ahead of the printer at most.
+     *
+     * Returns true on success (user abort = failure).
+     *
+     * @author Aleksander Demko
+     */
+    bool exportToPrinter(QPrinter *printer, ExportProgress *progress = 0);
+    /**
+     * Writes all the pages to a PDF file with PdfWriter (rather than
+     * QPrinter). Untouched JPEG files are embedded as is, leveled pages that
+     * are just black and white as 1-bit images, and the rest as JPEGs of the
+     * given quality.
+     *
+     * Returns true on success (user abort = failure).
+     *
+     * @author Aleksander Demko
+     */
+    bool exportToPdf(const QString &filename, ExportProgress *progress = 0,
+                     int quality = PdfWriter::DEFAULT_JPEG_QUALITY);
+    /// returns true on success (user abort or an unsaved page = failure)
     bool exportToFiles(const QString &seedFilename,
-                       QProgressDialog *progdlg = 0);
+                       ExportProgress *progress = 0);
 
     bool saveXML(const QString &filename);
 
@@ -349,13 +573,23 @@ class Project {
 
     FileList dm_files;
 
+    DiskCache dm_diskcache; // before dm_filecache, which uses it
     ImageFileCache dm_filecache;
+    StageCache dm_stagecache;
 
     typedef std::list<Listener *> ListenerList;
 
     ListenerList dm_listeners;
 
     int dm_step;
+    int dm_clipmapping;
+    int dm_exportdpi;
+
+    QThreadPool *dm_pagepool;
+    PagePipeline::Budget *dm_pagebudget;
+    ImageFileCache *dm_sharedfilecache;
+    DiskCache *dm_shareddiskcache;
+    int dm_exportlookahead;
 };
 
 #endif
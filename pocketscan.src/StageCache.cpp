@@ -0,0 +1,89 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <StageCache.h>
+
+#include <Stats.h>
+
+static qint64 defaultMaxBytes(void) {
+    return static_cast<qint64>(StageCache::DEFAULT_MAX_MB) * 1024 * 1024;
+}
+
+StageCache::StageCache(qint64 maxbytes)
+    : dm_maxbytes(maxbytes > 0 ? maxbytes : defaultMaxBytes()) {}
+
+void StageCache::setMaxBytes(qint64 maxbytes) {
+    dm_maxbytes = maxbytes > 0 ? maxbytes : defaultMaxBytes();
+    trim();
+}
+
+qint64 StageCache::byteCount(void) const {
+    qint64 total = 0;
+
+    // computed each time, as the pyramids may have grown levels since
+    for (EntryList::const_iterator ii = dm_entries.begin();
+         ii != dm_entries.end(); ++ii)
+        total += ii->stage->byteCount();
+
+    return total;
+}
+
+std::shared_ptr<ImagePyramid> StageCache::find(const QString &key) {
+    for (EntryList::iterator ii = dm_entries.begin(); ii != dm_entries.end();
+         ++ii)
+        if (ii->key == key) {
+            // move it to the front
+            dm_entries.splice(dm_entries.begin(), dm_entries, ii);
+            Stats::add("stagecache.hits");
+            return dm_entries.front().stage;
+        }
+
+    Stats::add("stagecache.misses");
+
+    return std::shared_ptr<ImagePyramid>();
+}
+
+void StageCache::insert(const QString &key,
+                        const std::shared_ptr<ImagePyramid> &stage) {
+    for (EntryList::iterator ii = dm_entries.begin(); ii != dm_entries.end();
+         ++ii)
+        if (ii->key == key) {
+            dm_entries.erase(ii);
+            break;
+        }
+
+    Entry entry;
+
+    entry.key = key;
+    entry.stage = stage;
+
+    dm_entries.push_front(entry);
+
+    trim();
+}
+
+void StageCache::clear(void) { dm_entries.clear(); }
+
+void StageCache::trim(void) {
+    qint64 total = byteCount();
+    EntryList::iterator ii = dm_entries.end();
+
+    // from the least recently used, but never the one just used
+    while (total > dm_maxbytes && ii != dm_entries.begin()) {
+        --ii;
+        if (ii == dm_entries.begin())
+            break;
+        if (ii->stage.use_count() > 1)
+            continue; // still held by someone
+
+        total -= ii->stage->byteCount();
+        ii = dm_entries.erase(ii);
+        Stats::add("stagecache.evictions");
+    }
+
+    Stats::set("stagecache.bytes", total);
+}
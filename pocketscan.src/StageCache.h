@@ -0,0 +1,79 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_STAGECACHE_H__
+#define __INCLUDED_POCKETSCAN_STAGECACHE_H__
+
+#include <list>
+
+#include <QString>
+
+#include <hydra/TR1.h>
+
+#include <ImagePyramid.h>
+
+/**
+ * A memo of the outputs of the preview pipeline's stages (the rotated
+ * image, the clipped and prescaled pre-level image...) so that revisiting
+ * a page, or flipping between steps, reuses them.
+ *
+ * Each stage is kept as an ImagePyramid (often just its base), under a key
+ * that must describe everything that went into making it (the source file
+ * and decoded size, the rotate code, the clip corners, the target
+ * size...). The cache is bounded by the bytes of the pyramids, evicting
+ * the least recently used first. Stages that are still held elsewhere
+ * (by a tile showing them) are never evicted, as that wouldn't free
+ * anything.
+ *
+ * Unlike ImageFileCache, this is only for the GUI thread.
+ *
+ * @author Aleksander Demko
+ */
+class StageCache {
+  public:
+    /// constructor, maxbytes of 0 meaning DEFAULT_MAX_MB
+    StageCache(qint64 maxbytes = 0);
+
+    static const int DEFAULT_MAX_MB = 128;
+
+    qint64 maxBytes(void) const { return dm_maxbytes; }
+    void setMaxBytes(qint64 maxbytes);
+
+    /// the bytes currently held
+    qint64 byteCount(void) const;
+
+    /**
+     * Returns the stage stored under the given key, or null if there
+     * is none.
+     *
+     * @author Aleksander Demko
+     */
+    std::shared_ptr<ImagePyramid> find(const QString &key);
+
+    /// stores the given stage, replacing any under the same key
+    void insert(const QString &key, const std::shared_ptr<ImagePyramid> &stage);
+
+    /// drops everything
+    void clear(void);
+
+  private:
+    /// evicts stages until within budget
+    void trim(void);
+
+  private:
+    struct Entry {
+        QString key;
+        std::shared_ptr<ImagePyramid> stage;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    qint64 dm_maxbytes;
+    EntryList dm_entries; // the most recently used first
+};
+
+#endif
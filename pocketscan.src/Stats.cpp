@@ -0,0 +1,162 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <Stats.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <array>
+
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+
+namespace {
+
+struct Histo {
+    qint64 count;
+    double sum, min, max;
+    // bucket 0 is < 1, bucket b is [2^(b-1), 2^b), the last one being
+    // everything bigger
+    std::array<qint64, Stats::NUM_BUCKETS> buckets;
+
+    Histo(void) : count(0), sum(0), min(0), max(0) { buckets.fill(0); }
+};
+
+struct Registry {
+    QMutex lock;
+    QHash<QByteArray, qint64> counters, gauges;
+    QHash<QByteArray, Histo> histos;
+};
+
+} // namespace
+
+static Registry &registry(void) {
+    static Registry r;
+
+    return r;
+}
+
+// lookups with raw names don't allocate, only the first insert copies
+static QByteArray rawName(const char *name) {
+    return QByteArray::fromRawData(name, static_cast<int>(strlen(name)));
+}
+
+template <class T>
+static T &lookup(QHash<QByteArray, T> &hash, const QByteArray &name) {
+    typename QHash<QByteArray, T>::iterator ii = hash.find(name);
+
+    if (ii == hash.end())
+        ii = hash.insert(QByteArray(name.constData(), name.size()), T());
+
+    return *ii;
+}
+
+void Stats::add(const char *name, qint64 delta) { add(rawName(name), delta); }
+
+void Stats::add(const QByteArray &name, qint64 delta) {
+    Registry &r = registry();
+    QMutexLocker L(&r.lock);
+
+    lookup(r.counters, name) += delta;
+}
+
+void Stats::set(const char *name, qint64 value) {
+    Registry &r = registry();
+    QMutexLocker L(&r.lock);
+
+    lookup(r.gauges, rawName(name)) = value;
+}
+
+void Stats::record(const char *name, double value) {
+    record(rawName(name), value);
+}
+
+void Stats::record(const QByteArray &name, double value) {
+    int bucket = 0;
+
+    for (double top = 1; bucket < NUM_BUCKETS - 1 && value >= top; top *= 2)
+        ++bucket;
+
+    Registry &r = registry();
+    QMutexLocker L(&r.lock);
+    Histo &h = lookup(r.histos, name);
+
+    if (h.count == 0 || value < h.min)
+        h.min = value;
+    if (h.count == 0 || value > h.max)
+        h.max = value;
+    h.count++;
+    h.sum += value;
+    h.buckets[bucket]++;
+}
+
+QByteArray Stats::toJson(void) {
+    Registry &r = registry();
+    QMutexLocker L(&r.lock);
+    QJsonObject counters, gauges, histos;
+
+    for (QHash<QByteArray, qint64>::const_iterator ii = r.counters.begin();
+         ii != r.counters.end(); ++ii)
+        counters[QString::fromLatin1(ii.key())] = static_cast<double>(*ii);
+    for (QHash<QByteArray, qint64>::const_iterator ii = r.gauges.begin();
+         ii != r.gauges.end(); ++ii)
+        gauges[QString::fromLatin1(ii.key())] = static_cast<double>(*ii);
+
+    for (QHash<QByteArray, Histo>::const_iterator ii = r.histos.begin();
+         ii != r.histos.end(); ++ii) {
+        const Histo &h = *ii;
+        QJsonObject o;
+        QJsonArray buckets;
+
+        o["count"] = static_cast<double>(h.count);
+        o["sum"] = h.sum;
+        o["min"] = h.min;
+        o["max"] = h.max;
+        o["mean"] = h.count > 0 ? h.sum / h.count : 0.0;
+
+        // trailing empty buckets are left off
+        int last = NUM_BUCKETS - 1;
+        while (last >= 0 && h.buckets[last] == 0)
+            --last;
+        for (int b = 0; b <= last; ++b)
+            buckets.append(static_cast<double>(h.buckets[b]));
+        o["buckets"] = buckets;
+
+        histos[QString::fromLatin1(ii.key())] = o;
+    }
+
+    QJsonObject root;
+
+    root["counters"] = counters;
+    root["gauges"] = gauges;
+    root["histograms"] = histos;
+
+    return QJsonDocument(root).toJson();
+}
+
+bool Stats::dump(const QString &filename) {
+    QFile f(filename);
+
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+
+    QByteArray json(toJson());
+
+    return f.write(json) == json.size();
+}
+
+void Stats::dumpAtExit(void) {
+    const char *filename = getenv("POCKETSCAN_STATS");
+
+    if (filename && *filename)
+        dump(QString::fromLocal8Bit(filename));
+}
@@ -0,0 +1,96 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_STATS_H__
+#define __INCLUDED_POCKETSCAN_STATS_H__
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+
+/**
+ * Process wide instrumentation, always compiled in: named counters, gauges
+ * and histograms, cheap enough to update from any thread on a per image
+ * (not per pixel) basis, and dumpable as JSON.
+ *
+ * Names are dotted, with the unit as a suffix for histograms
+ * ("filecache.decode_ms"). The const char * versions expect string
+ * literals (or other strings that live forever).
+ *
+ * @author Aleksander Demko
+ */
+class Stats {
+  public:
+    /// adds delta to the given counter
+    static void add(const char *name, qint64 delta = 1);
+    static void add(const QByteArray &name, qint64 delta = 1);
+
+    /// sets the given gauge (a value that goes up and down, like bytes held)
+    static void set(const char *name, qint64 value);
+
+    /**
+     * Records one sample into the given histogram. Histograms keep the
+     * count, sum, min and max of their samples, and counts in power of 2
+     * buckets.
+     *
+     * @author Aleksander Demko
+     */
+    static void record(const char *name, double value);
+    static void record(const QByteArray &name, double value);
+
+    /// all the stats, as a JSON document
+    static QByteArray toJson(void);
+
+    /// writes toJson() to the given file, returning false on errors
+    static bool dump(const QString &filename);
+
+    /**
+     * If the POCKETSCAN_STATS environment variable is set, dump()s to
+     * the file it names. Called at exit.
+     *
+     * @author Aleksander Demko
+     */
+    static void dumpAtExit(void);
+
+    static const int NUM_BUCKETS = 32;
+};
+
+/**
+ * Records its lifetime (in ms) into the given Stats histogram, when
+ * destructed.
+ *
+ * @author Aleksander Demko
+ */
+class StatsTimer {
+  public:
+    StatsTimer(const char *name) : dm_name(name), dm_lap(0) {
+        dm_timer.start();
+    }
+    ~StatsTimer() { Stats::record(dm_name, elapsedMs()); }
+
+    double elapsedMs(void) const { return dm_timer.nsecsElapsed() / 1.0e6; }
+
+    /**
+     * Records the time since the last lap (or the start) into the given
+     * histogram, for timing the stages of something.
+     *
+     * @author Aleksander Demko
+     */
+    void lap(const char *name) {
+        qint64 now = dm_timer.nsecsElapsed();
+
+        Stats::record(name, (now - dm_lap) / 1.0e6);
+        dm_lap = now;
+    }
+
+  private:
+    const char *dm_name;
+    QElapsedTimer dm_timer;
+    qint64 dm_lap; // in ns
+};
+
+#endif
@@ -8,10 +8,14 @@
 #include <TileView.h>
 
 #include <assert.h>
+#include <math.h>
+
+#include <algorithm>
 
 #include <QAction>
 #include <QApplication>
 #include <QCheckBox>
+#include <QDataStream>
 #include <QDebug>
 #include <QFileInfo>
 #include <QLabel>
@@ -23,27 +27,42 @@
 
 #include <DynamicSlot.h>
 
+#include <ImagePyramid.h>
 #include <LevelEditor.h>
 #include <MathUtil.h>
+#include <Trace.h>
+
+/**
+ * Returns how big (in the orientation of the file) the source image needs to
+ * be for a preview that fills window without being scaled up. This is less
+ * than the full size, unless the preview is clipped down to a small
+ * part of the page.
+ *
+ * @author Aleksander Demko
+ */
+static QSize previewSourceSize(const Project::FileEntry &entry, QSize filesize,
+                               QSize window, bool doclip) {
+    QSize fullsize(entry.transformOp.applySize(filesize));
+    QSize want(calcAspect(fullsize, window, false));
+
+    if (doclip) {
+        ClipAlg::PointArray pixcorners;
+        QSize natural(ClipAlg::computePixCorners(
+            fullsize, entry.clipOp.corners(), pixcorners));
+
+        if (!natural.isEmpty()) {
+            QSize out(calcAspect(natural, window, false));
+            double scale = std::max(
+                static_cast<double>(out.width()) / natural.width(),
+                static_cast<double>(out.height()) / natural.height());
+
+            want = QSize(static_cast<int>(ceil(fullsize.width() * scale)),
+                         static_cast<int>(ceil(fullsize.height() * scale)));
+        }
+    }
 
-static QImage imageShrink(const QImage &img) {
-    /*QSize s(img.size());
-    QSize ideal(400,400);
-
-    if (s.isEmpty())
-      return img;
-
-    while (s.width() > ideal.width() || s.height() > ideal.height()) {
-      s.rwidth() /= 2;
-      s.rheight() /= 2;
-    }*/
-    QSize s = calcAspectEven(img.size(), QSize(400, 400), false);
-    // qDebug() << img.size() << s;
-
-    if (s != img.size())
-        return img.scaled(s, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-    else
-        return img;
+    // back into the orientation of the file
+    return entry.transformOp.applySize(want);
 }
 
 class TileView::Tile : public QWidget, public Listener {
@@ -66,6 +85,9 @@ class TileView::Tile : public QWidget, public Listener {
 
     QImage preLevelImage(void) const { return dm_prelevelimage; }
 
+    /// the histogram of preLevelImage(), computed on first use
+    const Histogram &preLevelHistogram(void);
+
   protected:
     virtual void resizeEvent(QResizeEvent *event);
     virtual void paintEvent(QPaintEvent *event);
@@ -104,11 +126,20 @@ class TileView::Tile : public QWidget, public Listener {
 
     int dm_mystep;
 
-    QString dm_imgfilename;
-    desktop::cache_ptr<QImage> dm_img;
+    QString dm_imgfilename; // empty for none
     QPixmap dm_pixmap;
 
+    // the pyramid of a (just big enough) level of the file, as rotated,
+    // shared with the StageCache under dm_pyramidkey
+    std::shared_ptr<ImagePyramid> dm_pyramid;
+    QString dm_pyramidkey;
+
     QImage dm_prelevelimage;
+    Histogram dm_prelevelhisto;
+    bool dm_prelevelhistovalid;
+    // the DiskCache item of dm_prelevelhisto, describing how
+    // dm_prelevelimage was made
+    QString dm_prelevelitem;
 
     // box selection stuff
 
@@ -207,6 +238,7 @@ TileView::Tile::Tile(Project *p) : dm_project(p), dm_toolbar(0) {
     dm_dirty = true;
     dm_justleveldirty = false;
     dm_fileindex = -1;
+    dm_prelevelhistovalid = false;
 
     dm_mystep = dm_project->step();
 
@@ -219,7 +251,12 @@ TileView::Tile::Tile(Project *p) : dm_project(p), dm_toolbar(0) {
     initGui();
 }
 
-TileView::Tile::~Tile() { dm_project->removeListener(this); }
+TileView::Tile::~Tile() {
+    if (!dm_imgfilename.isEmpty())
+        dm_project->fileCache().unpin(dm_imgfilename);
+
+    dm_project->removeListener(this);
+}
 
 void TileView::Tile::handleProjectChanged(Listener *source) {
     // if (dm_project->step() == dm_mystep)
@@ -247,14 +284,21 @@ void TileView::Tile::setCurrentIndex(int i) {
     dm_fileindex = i;
 
     if (dm_fileindex >= dm_project->files().size()) {
-        dm_img = desktop::cache_ptr<QImage>();
+        if (!dm_imgfilename.isEmpty())
+            dm_project->fileCache().unpin(dm_imgfilename);
         dm_imgfilename.clear();
+        dm_pyramid.reset();
     } else {
         const QString &fileName = dm_project->files()[dm_fileindex].fileName;
 
         if (fileName != dm_imgfilename) {
+            // keep the shown file in the cache
+            dm_project->fileCache().pin(fileName);
+            if (!dm_imgfilename.isEmpty())
+                dm_project->fileCache().unpin(dm_imgfilename);
+
             dm_imgfilename = fileName;
-            dm_img = dm_project->fileCache().getImage(dm_imgfilename);
+            dm_pyramid.reset();
         }
     }
 
@@ -270,15 +314,43 @@ void TileView::Tile::clipChanged(void) {
 
 void TileView::Tile::levelChanged(void) { setJustLevelDirty(); }
 
+const Histogram &TileView::Tile::preLevelHistogram(void) {
+    if (!dm_prelevelhistovalid) {
+        DiskCache &disk = dm_project->diskCache();
+        QByteArray data;
+        bool loaded = false;
+
+        if (disk.load(dm_imgfilename, dm_prelevelitem, data)) {
+            QDataStream in(data);
+
+            loaded = dm_prelevelhisto.loadData(in);
+        }
+
+        if (!loaded) {
+            dm_prelevelhisto.computeHistogram(dm_prelevelimage);
+            data.clear();
+
+            QDataStream out(&data, QIODevice::WriteOnly);
+
+            dm_prelevelhisto.saveData(out);
+            disk.store(dm_imgfilename, dm_prelevelitem, data);
+        }
+        dm_prelevelhistovalid = true;
+    }
+
+    return dm_prelevelhisto;
+}
+
 void TileView::Tile::resizeEvent(QResizeEvent *event) { dm_dirty = true; }
 
 void TileView::Tile::paintEvent(QPaintEvent *event) {
+    TRACE_SCOPE("Tile::paintEvent");
     QPainter dc(this);
 
     dc.setBackground(Qt::white);
 
     if (dm_dirty || dm_justleveldirty) {
-        if (dm_img.get() == 0)
+        if (dm_imgfilename.isEmpty())
             dm_pixmap = QPixmap();
         else {
             Project::FileEntry &entry = dm_project->files()[dm_fileindex];
@@ -286,18 +358,47 @@ void TileView::Tile::paintEvent(QPaintEvent *event) {
             QImage img;
 
             if (!dm_justleveldirty) {
+                TRACE_SCOPE("Tile prepare");
+
                 if (!entry.didExifCheck) {
                     entry.didExifCheck = true;
                     entry.transformOp = entry.computeAutoTransformOp();
                 }
-                img = entry.transformOp.apply(*dm_img);
+                ImageFileCache &cache = dm_project->fileCache();
+                bool doclip = dm_mystep >= StepList::LEVEL_STEP &&
+                              entry.usingClip && !entry.clipOp.isReset() &&
+                              entry.clipOp.size() == ClipOp::MAX_SIZE;
+                std::shared_ptr<QImage> src = cache.getImage(
+                    dm_imgfilename,
+                    previewSourceSize(entry, cache.imageSize(dm_imgfilename),
+                                      dc.window().size(), doclip));
+
+                StageCache &stages = dm_project->stageCache();
+                // the rotated image (and its smaller levels) is kept between
+                // repaints, and in the StageCache for revisits
+                QString key(QString("%1 %2x%3 rotate %4")
+                                .arg(dm_imgfilename)
+                                .arg(src->width())
+                                .arg(src->height())
+                                .arg(entry.transformOp.rotateCode()));
+
+                if (!dm_pyramid || dm_pyramidkey != key) {
+                    dm_pyramid = stages.find(key);
+                    if (!dm_pyramid) {
+                        dm_pyramid.reset(
+                            new ImagePyramid(entry.transformOp.apply(*src)));
+                        stages.insert(key, dm_pyramid);
+                    }
+                    dm_pyramidkey = key;
+                }
+                img = dm_pyramid->base();
 
                 if (dm_mystep == StepList::CROP_STEP) {
                     if (!entry.didClipCheck) {
                         entry.didClipCheck = true;
                         ClipOp newclip;
-                        if (entry.computeAutoClipOp(imageShrink(img),
-                                                    newclip)) {
+                        // on the same image as autoAnalyze, not the tile's
+                        if (dm_project->computeAutoClipOp(entry, newclip)) {
                             // img.save("/tmp/lastimg" +
                             // QString::number(dm_fileindex) + ".png");
                             entry.usingClip = true;
@@ -308,13 +409,33 @@ void TileView::Tile::paintEvent(QPaintEvent *event) {
                     }
                 }
 
+                // how the pre-level image is made from the rotated one
+                QString clipkey;
+
+                if (dm_mystep >= StepList::LEVEL_STEP && entry.usingClip) {
+                    clipkey = " clip " +
+                              QString::number(dm_project->clipMapping());
+                    for (int i = 0; i < entry.clipOp.size(); ++i)
+                        clipkey += QString(" %1,%2")
+                                       .arg(entry.clipOp[i].x())
+                                       .arg(entry.clipOp[i].y());
+                }
+
+                QString prelevelkey(key + clipkey +
+                                    QString(" window %1x%2")
+                                        .arg(dc.window().width())
+                                        .arg(dc.window().height()));
+                std::shared_ptr<ImagePyramid> prelevel(
+                    stages.find(prelevelkey));
+
                 bool didclip = false;
-                if (dm_mystep >= StepList::LEVEL_STEP)
-                    if (entry.usingClip) {
-                        didclip = false;
-                        img =
-                            entry.clipOp.apply(img, QSize(dc.window().size()));
-                    }
+                if (prelevel) {
+                    img = prelevel->base();
+                    didclip = true; // and prescaled
+                } else if (!clipkey.isEmpty())
+                    img = entry.clipOp.apply(*dm_pyramid,
+                                             QSize(dc.window().size()),
+                                             dm_project->clipMapping());
 
                 // prescale for the screen so the levelator doesnt have to work
                 // on the whole image huge, optional performance boost
@@ -326,12 +447,30 @@ void TileView::Tile::paintEvent(QPaintEvent *event) {
                     // Qt::SmoothTransformation);
                     QSize s;
                     s = calcAspect(img.size(), dc.window().size(), false);
-                    if (s != img.size())
+                    if (s != img.size()) {
+                        // still the unclipped image? then scale from the
+                        // closest pyramid level rather than the full one
+                        if (img.cacheKey() == dm_pyramid->base().cacheKey())
+                            img = dm_pyramid->level(dm_pyramid->levelFor(s));
                         img = img.scaled(s, Qt::IgnoreAspectRatio,
                                          Qt::SmoothTransformation);
+                    }
+
+                    // (not when its just the rotated image, which is
+                    // already kept)
+                    if (img.cacheKey() != dm_pyramid->base().cacheKey())
+                        stages.insert(prelevelkey,
+                                      std::shared_ptr<ImagePyramid>(
+                                          new ImagePyramid(img)));
                 }
 
                 dm_prelevelimage = img;
+                dm_prelevelhistovalid = false;
+                dm_prelevelitem =
+                    "histogram " +
+                    QString::number(entry.transformOp.rotateCode()) +
+                    clipkey +
+                    QString(" %1x%2").arg(img.width()).arg(img.height());
             }
 
             // do leveling
@@ -339,9 +478,8 @@ void TileView::Tile::paintEvent(QPaintEvent *event) {
                 // see if we need to do an automatic calc first
                 if (!entry.didlevelCheck) {
                     entry.didlevelCheck = true;
-                    Histogram h(dm_prelevelimage);
                     LevelOp newop;
-                    if (entry.computeAutoLevelOp(h, newop)) {
+                    if (dm_project->computeAutoLevelOp(entry, newop)) {
                         entry.usingLevel = true;
                         entry.levelOp = newop;
                     }
@@ -775,7 +913,7 @@ void TileView::ToolBar::prelevelImageChanged(void) {
     if (!dm_level_editor)
         return;
 
-    Histogram h(dm_tile->preLevelImage());
+    const Histogram &h = dm_tile->preLevelHistogram();
     if (h.countMax() > 0)
         dm_level_editor->setHisto(h);
 }
@@ -1058,8 +1196,7 @@ void TileView::ToolBar::onButton(void) {
             entry.didlevelCheck = true;
 
         LevelOp newop;
-        Histogram h(dm_tile->preLevelImage());
-        entry.computeAutoLevelOp(h, newop);
+        dm_project->computeAutoLevelOp(entry, newop);
 
         entry.usingLevel = true;
         entry.levelOp = newop;
@@ -1200,27 +1337,121 @@ void TileView::Widget::setCurrentIndex(int i) {
 //
 //
 
-TileView::TileView(Project *p) : dm_project(p) {
+const double TileView::PREFETCH_SECONDS = 0.5;
+
+TileView::TileView(Project *p)
+    : dm_project(p), dm_prefetcher(p->fileCache()) {
     assert(p);
 
     dm_baseindex = 0;
+    dm_scrolldir = 0;
+    dm_scrollrate = 0;
     dm_project->addListener(this);
 
     initGui();
 }
 
-TileView::~TileView() { dm_project->removeListener(this); }
+TileView::~TileView() {
+    dm_prefetcher.cancel();
+
+    dm_project->removeListener(this);
+}
 
 void TileView::handleProjectChanged(Listener *source) {
     for (int x = 0; x < dm_widgets.size(); ++x)
         dm_widgets[x]->setCurrentIndex(dm_baseindex + x);
+
+    // the step may have changed, and with it what the pages need decoded
+    prefetchPages(0);
 }
 
 void TileView::setBaseIndex(int newbase) {
+    int delta = newbase - dm_baseindex;
+
     dm_baseindex = newbase;
 
     for (int x = 0; x < dm_widgets.size(); ++x)
         dm_widgets[x]->setCurrentIndex(dm_baseindex + x);
+
+    prefetchPages(delta);
+}
+
+void TileView::prefetchPages(int delta) {
+    int dir = delta > 0 ? 1 : delta < 0 ? -1 : dm_scrolldir;
+    qint64 ms = dm_scrolltimer.isValid() ? dm_scrolltimer.restart() : 0;
+
+    if (!dm_scrolltimer.isValid())
+        dm_scrolltimer.start();
+
+    if (dir != dm_scrolldir) {
+        // turned around, whatever is queued is now in the wrong direction
+        dm_prefetcher.cancel();
+        dm_scrollrate = 0;
+    } else if (ms > 0)
+        dm_scrollrate = (dm_scrollrate + delta * dir * 1000.0 / ms) / 2;
+    dm_scrolldir = dir;
+
+    if (dm_widgets.empty())
+        return;
+
+    int numfiles = static_cast<int>(dm_project->files().size());
+    int numtiles = static_cast<int>(dm_widgets.size());
+    int ahead = PREFETCH_PAGES;
+    int behind = PREFETCH_PAGES;
+
+    if (dir != 0) {
+        ahead += static_cast<int>(dm_scrollrate * PREFETCH_SECONDS);
+        if (ahead > MAX_PREFETCH_PAGES)
+            ahead = MAX_PREFETCH_PAGES;
+        behind = 1;
+    }
+
+    // what the tiles would ask for (see Tile::paintEvent)
+    QSize window(dm_widgets[0]->tile->size());
+    int step = dm_project->step();
+    bool doclip = step >= StepList::LEVEL_STEP;
+    ImagePrefetcher::JobList jobs;
+
+    // the tiles in view first (i < 0), then the nearest first, ahead before
+    // behind
+    for (int i = -numtiles; i < ahead + behind; ++i) {
+        int next = i < ahead ? i : i - ahead;
+        int index;
+
+        if (i < 0)
+            index = dm_baseindex + numtiles + i;
+        else if ((i < ahead) == (dir >= 0))
+            index = dm_baseindex + numtiles + next;
+        else
+            index = dm_baseindex - 1 - next;
+
+        if (index < 0 || index >= numfiles)
+            continue;
+
+        const Project::FileEntry &entry = dm_project->files()[index];
+        bool clipped = doclip && entry.usingClip && !entry.clipOp.isReset() &&
+                       entry.clipOp.size() == ClipOp::MAX_SIZE;
+
+        // a page that is yet to be auto clipped or leveled at this step
+        // will also want its analysisImage. thats usually the finer decode,
+        // so its queued first, letting the preview's be skipped (as the
+        // cache can halve that one down)
+        if ((step == StepList::CROP_STEP && !entry.didClipCheck) ||
+            (step >= StepList::LEVEL_STEP && !entry.didlevelCheck))
+            jobs.push_back(
+                ImagePrefetcher::Job(entry.fileName, [](QSize filesize) {
+                    return Project::analysisSourceSize(filesize);
+                }));
+
+        // the tiles in view decode their own previews as they paint
+        if (i >= 0)
+            jobs.push_back(ImagePrefetcher::Job(
+                entry.fileName, [entry, window, clipped](QSize filesize) {
+                    return previewSourceSize(entry, filesize, window, clipped);
+                }));
+    }
+
+    dm_prefetcher.prefetch(jobs);
 }
 
 void TileView::initGui(void) {
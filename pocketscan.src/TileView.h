@@ -10,10 +10,12 @@
 
 #include <vector>
 
+#include <QElapsedTimer>
 #include <QHBoxLayout>
 #include <QScrollBar>
 #include <QWidget>
 
+#include <ImagePrefetcher.h>
 #include <Project.h>
 
 /**
@@ -40,7 +42,23 @@ class TileView : public QWidget, public Listener {
 
     void setTileSize(int s);
 
+    /**
+     * Queues the pages around the view for decoding, more of them in
+     * the direction being scrolled (delta being the change in the base index)
+     * and the faster that is.
+     *
+     * @author Aleksander Demko
+     */
+    void prefetchPages(int delta);
+
   private:
+    // pages to prefetch on either side, when not going anywhere
+    static const int PREFETCH_PAGES = 3;
+    // the most pages to prefetch ahead, when scrolling fast
+    static const int MAX_PREFETCH_PAGES = 12;
+    // prefetch as many pages ahead as scrolled in this many seconds
+    static const double PREFETCH_SECONDS;
+
     class Tile;
     class ToolBar; // still short on names :)
     class Widget;  // yeah, im short on names here :)
@@ -53,6 +71,11 @@ class TileView : public QWidget, public Listener {
     int dm_baseindex;
 
     Project *dm_project;
+
+    ImagePrefetcher dm_prefetcher;
+    QElapsedTimer dm_scrolltimer;
+    int dm_scrolldir;     // -1, 0 or 1
+    double dm_scrollrate; // in pages per second, smoothed
 };
 
 /**
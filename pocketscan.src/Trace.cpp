@@ -0,0 +1,164 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#include <Trace.h>
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+
+QAtomicInt Trace::s_enabled;
+
+namespace {
+
+struct Event {
+    const char *name, *cat;
+    qint64 ts, dur; // in us
+    int tid;
+};
+
+struct Recorder {
+    QString filename;
+    QElapsedTimer clock;
+
+    QMutex lock;
+    std::vector<Event> events;
+    QStringList threadnames; // indexed by tid
+
+    QAtomicInt nexttid;
+};
+
+} // namespace
+
+static Recorder &recorder(void) {
+    static Recorder r;
+
+    return r;
+}
+
+// small, stable thread ids, in the order threads first trace something
+static thread_local int tl_tid = -1;
+
+void Trace::start(const QString &filename) {
+    Recorder &r = recorder();
+
+    r.filename = filename;
+    r.clock.start();
+    s_enabled.storeRelease(1);
+}
+
+void Trace::startFromArguments(QStringList &args) {
+    int at = args.indexOf("--trace");
+
+    if (at >= 0 && at + 1 < args.size()) {
+        start(args[at + 1]);
+        args.removeAt(at + 1);
+        args.removeAt(at);
+        return;
+    }
+
+    const char *filename = getenv("POCKETSCAN_TRACE");
+
+    if (filename && *filename)
+        start(QString::fromLocal8Bit(filename));
+}
+
+qint64 Trace::now(void) { return recorder().clock.nsecsElapsed() / 1000; }
+
+void Trace::complete(const char *name, const char *cat, qint64 startus,
+                     qint64 durus) {
+    Recorder &r = recorder();
+
+    if (tl_tid < 0) {
+        bool ismain = QCoreApplication::instance() &&
+                      QThread::currentThread() ==
+                          QCoreApplication::instance()->thread();
+
+        tl_tid = r.nexttid.fetchAndAddRelaxed(1);
+
+        QMutexLocker L(&r.lock);
+
+        while (r.threadnames.size() <= tl_tid)
+            r.threadnames.append(QString());
+        r.threadnames[tl_tid] =
+            ismain ? QString("main") : "thread " + QString::number(tl_tid);
+    }
+
+    Event e = {name, cat, startus, durus, tl_tid};
+    QMutexLocker L(&r.lock);
+
+    // stop() may have already written the file
+    if (isEnabled())
+        r.events.push_back(e);
+}
+
+// the names are literals, but be safe anyways
+static QByteArray jsonString(const char *s) {
+    QByteArray ret("\"");
+
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            ret += '\\';
+        ret += *s;
+    }
+    ret += '"';
+
+    return ret;
+}
+
+bool Trace::stop(void) {
+    if (!s_enabled.fetchAndStoreOrdered(0))
+        return true;
+
+    Recorder &r = recorder();
+    QMutexLocker L(&r.lock);
+    QFile f(r.filename);
+
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+
+    QByteArray out("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *sep = "";
+
+    for (int tid = 0; tid < r.threadnames.size(); ++tid) {
+        out += sep;
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+               QByteArray::number(tid) + ",\"args\":{\"name\":" +
+               jsonString(r.threadnames[tid].toUtf8().constData()) + "}}";
+        sep = ",\n";
+    }
+
+    for (size_t i = 0; i < r.events.size(); ++i) {
+        const Event &e = r.events[i];
+
+        out += sep;
+        out += "{\"name\":" + jsonString(e.name) +
+               ",\"cat\":" + jsonString(e.cat) +
+               ",\"ph\":\"X\",\"pid\":1,\"tid\":" + QByteArray::number(e.tid) +
+               ",\"ts\":" + QByteArray::number(e.ts) +
+               ",\"dur\":" + QByteArray::number(e.dur) + "}";
+        sep = ",\n";
+
+        // dont let the buffer get too big
+        if (out.size() > 1024 * 1024) {
+            f.write(out);
+            out.clear();
+        }
+    }
+    out += "\n]}\n";
+
+    r.events.clear();
+
+    return f.write(out) == out.size() && f.flush();
+}
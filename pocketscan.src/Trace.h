@@ -0,0 +1,109 @@
+
+/*
+ * Copyright (c) 2010    Aleksander B. Demko
+ * This source code is distributed under the MIT license.
+ * See the accompanying file LICENSE.MIT.txt for details.
+ */
+
+#ifndef __INCLUDED_POCKETSCAN_TRACE_H__
+#define __INCLUDED_POCKETSCAN_TRACE_H__
+
+#include <QAtomicInt>
+#include <QString>
+#include <QStringList>
+
+/**
+ * Timeline tracing, in the Chrome trace event format (which chrome://tracing
+ * and Perfetto open). Spans are marked with TRACE_SCOPE (or TraceScope),
+ * buffered in memory and written out by stop().
+ *
+ * When tracing is off (the default), a span costs one test of a flag.
+ *
+ * @author Aleksander Demko
+ */
+class Trace {
+  public:
+    /// is tracing on?
+    static bool isEnabled(void) { return s_enabled.loadAcquire() != 0; }
+
+    /**
+     * Turns tracing on, to be written to the given file on stop().
+     * Should be called at startup, before any other threads are started.
+     *
+     * @author Aleksander Demko
+     */
+    static void start(const QString &filename);
+
+    /**
+     * Starts tracing if the arguments have a --trace filename switch
+     * (which is then removed from them) or if the POCKETSCAN_TRACE
+     * environment variable names a file.
+     *
+     * @author Aleksander Demko
+     */
+    static void startFromArguments(QStringList &args);
+
+    /**
+     * Turns tracing off and writes the file, returning false on errors.
+     * Should be called once the worker threads are done, as spans still
+     * running then are dropped.
+     *
+     * @author Aleksander Demko
+     */
+    static bool stop(void);
+
+    /// the time since start(), in microseconds
+    static qint64 now(void);
+
+    /// records a complete span. name and cat must live forever (literals)
+    static void complete(const char *name, const char *cat, qint64 startus,
+                         qint64 durus);
+
+  private:
+    static QAtomicInt s_enabled;
+};
+
+/**
+ * Records a span over its lifetime, if tracing is on.
+ * name and cat must be string literals (or live forever).
+ *
+ * @author Aleksander Demko
+ */
+class TraceScope {
+  public:
+    TraceScope(const char *name, const char *cat = "pocketscan") : dm_name(0) {
+        if (Trace::isEnabled()) {
+            dm_name = name;
+            dm_cat = cat;
+            dm_start = Trace::now();
+        }
+    }
+    ~TraceScope() {
+        if (dm_name)
+            Trace::complete(dm_name, dm_cat, dm_start, Trace::now() - dm_start);
+    }
+
+    /// ends this span and starts the given one in its place, for stages
+    void next(const char *name) {
+        if (dm_name) {
+            qint64 now = Trace::now();
+
+            Trace::complete(dm_name, dm_cat, dm_start, now - dm_start);
+            dm_name = name;
+            dm_start = now;
+        }
+    }
+
+  private:
+    const char *dm_name; // null when not tracing
+    const char *dm_cat;
+    qint64 dm_start;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+/// traces the rest of the enclosing scope under the given name
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(tracescope_, __LINE__)(name)
+
+#endif